@@ -28,6 +28,9 @@ enum ins_opcode_t {
 	ALLOC,	// Allocate memory
 #ifdef MM_PAGING
 	MALLOC, // Allocate dynamic memory
+	FORK,	// Clone the process, memory is shared copy-on-write
+	SHMAT,	// Attach a shared memory segment, created on first use
+	SHMDT,	// Detach a shared memory segment
 #endif
 	FREE,	// Deallocated a memory block
 	READ,	// Write data to a byte on memory
@@ -5,5 +5,8 @@
 
 struct pcb_t * load(const char * path);
 
+/* Clone a PCB for a forked child, the memory is left to the caller */
+struct pcb_t * clone_proc(struct pcb_t * parent);
+
 #endif
 
@@ -3,17 +3,37 @@
 #include "bitops.h"
 #include "common.h"
 
+/* Paging geometry, set from the configuration by init_paging */
+extern int mm_pagesz, mm_page_shift, mm_bus_width;
+
 /* CPU Bus definition */
-#define PAGING_CPU_BUS_WIDTH 22 /* 22bit bus - MAX SPACE 4MB */
-#define PAGING_PAGESZ  256      /* 256B or 8-bits PAGE NUMBER */
+#define PAGING_CPU_BUS_WIDTH mm_bus_width /* 22bit bus by default - MAX SPACE 4MB */
+#define PAGING_PAGESZ  mm_pagesz          /* 256B by default */
+#define PAGING_PAGE_SHIFT mm_page_shift   /* log2 of PAGING_PAGESZ */
 #define PAGING_MEMRAMSZ BIT(10) /* 1MB */
 #define PAGING_PAGE_ALIGNSZ(sz) (DIV_ROUND_UP(sz,PAGING_PAGESZ)*PAGING_PAGESZ)
 
+#define PAGING_DEF_PAGESZ 256
+#define PAGING_DEF_BUS_WIDTH 22
+#define PAGING_MIN_PAGESZ 64
+#define PAGING_MAX_PAGESZ 65536    /* pages are staged on the host stack */
+#define PAGING_MAX_BUS_WIDTH 31    /* virtual addresses are int */
+
 #define PAGING_MEMSWPSZ BIT(14) /* 16MB */
 #define PAGING_SWPFPN_OFFSET 5  
 #define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+#ifdef MM_PTE64
+/* PTE BIT */
+#define PAGING_PTE_PRESENT_MASK BIT_ULL(63)
+#define PAGING_PTE_SWAPPED_MASK BIT_ULL(62)
+#define PAGING_PTE_RESERVE_MASK BIT_ULL(61)
+#define PAGING_PTE_DIRTY_MASK BIT_ULL(60)
+#define PAGING_PTE_EMPTY01_MASK BIT_ULL(45)
+#define PAGING_PTE_EMPTY02_MASK BIT_ULL(44)
+#define PAGING_PTE_HUGE_MASK BIT_ULL(59)
+#else
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
@@ -21,14 +41,44 @@
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
+#define PAGING_PTE_HUGE_MASK BIT(27)
+#endif
+
+/* Referenced bit, only meaningful while the page is in MEMRAM */
+#define PAGING_PTE_REF_MASK PAGING_PTE_EMPTY01_MASK
+/* Copy-on-write, frame shared read-only after fork, only meaningful in MEMRAM */
+#define PAGING_PTE_COW_MASK PAGING_PTE_EMPTY02_MASK
+/* Page of a shared memory segment, kept while swapped or not faulted yet */
+#define PAGING_PTE_SHM_MASK PAGING_PTE_RESERVE_MASK
+/* PAGING_PTE_HUGE_MASK: frame part of a huge page of mm_huge_pgn pages */
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
 #define PAGING_PTE_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
 
+#ifdef MM_PTE64
+/* USRNUM */
+#define PAGING_PTE_USRNUM_LOBIT 46
+#define PAGING_PTE_USRNUM_HIBIT 58
+/* FPN */
+#define PAGING_PTE_FPN_LOBIT 0
+#define PAGING_PTE_FPN_HIBIT 43
+/* SWPTYP */
+#define PAGING_PTE_SWPTYP_LOBIT 0
+#define PAGING_PTE_SWPTYP_HIBIT 4
+/* SWPOFF */
+#define PAGING_PTE_SWPOFF_LOBIT 5
+#define PAGING_PTE_SWPOFF_HIBIT 43
+
+/* PTE masks */
+#define PAGING_PTE_USRNUM_MASK GENMASK_ULL(PAGING_PTE_USRNUM_HIBIT,PAGING_PTE_USRNUM_LOBIT)
+#define PAGING_PTE_FPN_MASK    GENMASK_ULL(PAGING_PTE_FPN_HIBIT,PAGING_PTE_FPN_LOBIT)
+#define PAGING_PTE_SWPTYP_MASK GENMASK_ULL(PAGING_PTE_SWPTYP_HIBIT,PAGING_PTE_SWPTYP_LOBIT)
+#define PAGING_PTE_SWPOFF_MASK GENMASK_ULL(PAGING_PTE_SWPOFF_HIBIT,PAGING_PTE_SWPOFF_LOBIT)
+#else
 /* USRNUM */
 #define PAGING_PTE_USRNUM_LOBIT 15
-#define PAGING_PTE_USRNUM_HIBIT 27
+#define PAGING_PTE_USRNUM_HIBIT 26
 /* FPN */
 #define PAGING_PTE_FPN_LOBIT 0
 #define PAGING_PTE_FPN_HIBIT 12
@@ -44,27 +94,33 @@
 #define PAGING_PTE_FPN_MASK    GENMASK(PAGING_PTE_FPN_HIBIT,PAGING_PTE_FPN_LOBIT)
 #define PAGING_PTE_SWPTYP_MASK GENMASK(PAGING_PTE_SWPTYP_HIBIT,PAGING_PTE_SWPTYP_LOBIT)
 #define PAGING_PTE_SWPOFF_MASK GENMASK(PAGING_PTE_SWPOFF_HIBIT,PAGING_PTE_SWPOFF_LOBIT)
+#endif
+
+/* Largest frame number and swap offset a PTE can hold */
+#define PAGING_PTE_MAX_FPN    (PAGING_PTE_FPN_MASK >> PAGING_PTE_FPN_LOBIT)
+#define PAGING_PTE_MAX_SWPOFF (PAGING_PTE_SWPOFF_MASK >> PAGING_PTE_SWPOFF_LOBIT)
 
 /* Extract PTE */
 #define PAGING_PTE_OFFST(pte) GETVAL(pte,PAGING_OFFST_MASK,PAGING_ADDR_OFFST_LOBIT)
 #define PAGING_PTE_PGN(pte)   GETVAL(pte,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
 #define PAGING_PTE_FPN(pte)   GETVAL(pte,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
 #define PAGING_PTE_SWP(pte)   GETVAL(pte,PAGING_PTE_SWPOFF_MASK,PAGING_SWPFPN_OFFSET)
+#define PAGING_PTE_SWPTYP(pte) GETVAL(pte,PAGING_PTE_SWPTYP_MASK,PAGING_PTE_SWPTYP_LOBIT)
 
 /* OFFSET */
 #define PAGING_ADDR_OFFST_LOBIT 0
-#define PAGING_ADDR_OFFST_HIBIT (NBITS(PAGING_PAGESZ) - 1)
+#define PAGING_ADDR_OFFST_HIBIT (PAGING_PAGE_SHIFT - 1)
 
 /* PAGE Num */
-#define PAGING_ADDR_PGN_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_ADDR_PGN_LOBIT PAGING_PAGE_SHIFT
 #define PAGING_ADDR_PGN_HIBIT (PAGING_CPU_BUS_WIDTH - 1)
 
 /* Frame PHY Num */
-#define PAGING_ADDR_FPN_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_ADDR_FPN_LOBIT PAGING_PAGE_SHIFT
 #define PAGING_ADDR_FPN_HIBIT (NBITS(PAGING_MEMRAMSZ) - 1)
 
 /* SWAPFPN */
-#define PAGING_SWP_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_SWP_LOBIT PAGING_PAGE_SHIFT
 #define PAGING_SWP_HIBIT (NBITS(PAGING_MEMSWPSZ) - 1)
 #define PAGING_SWP(pte) ((pte&PAGING_SWP_MASK) >> PAGING_SWPFPN_OFFSET) 
 
@@ -112,9 +168,13 @@ int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int inc
 int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
-int pte_set_fpn(uint32_t *pte, int fpn);
-int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
-int init_pte(uint32_t *pte,
+int pte_set_fpn(pte_t *pte, int fpn);
+void pte_set_ref(pte_t *pte);
+void pte_set_dirty(pte_t *pte);
+void pte_set_cow(pte_t *pte);
+int pte_test_clear_ref(pte_t *pte);
+int pte_set_swap(pte_t *pte, int swptyp, int swpoff);
+int init_pte(pte_t *pte,
              int pre,    // present
              int fpn,    // FPN
              int drt,    // dirty
@@ -125,6 +185,10 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 int __free(struct pcb_t *caller, int rgid); 
 int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data); 
 int __write(struct pcb_t *caller, int rgid, int offset, BYTE value);    
+int __fork(struct pcb_t *caller, struct pcb_t *child);
+int __shmat(struct pcb_t *caller, int key, int size, int rgid);
+int __shmdt(struct pcb_t *caller, int rgid);
+int init_paging(int ramsz, int *swpsz, int nswp);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
 
 /* VM prototypes */
@@ -141,24 +205,186 @@ int pgwrite(
 		BYTE data, // Data to be wrttien into memory
 		uint32_t destination, // Index of destination register
 		uint32_t offset);
+int pgfork(struct pcb_t *proc, struct pcb_t *child);
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t size, uint32_t reg_index);
+int pgshmdt(struct pcb_t *proc, uint32_t reg_index);
 /* Local VM prototypes */
 struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
+struct vm_rg_struct * alloc_symrg_byid(struct mm_struct* mm, int rgid);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int *inc_limit_ret);
-int find_victim_page(struct mm_struct* mm, int *pgn);
+int find_victim_page(struct memphy_struct *mram, struct mm_struct *mm, int *pgn, int *fpn);
+int find_victim_frame(struct memphy_struct *mram, struct mm_struct *mm,
+                      struct mm_struct **vicmm, int *vicpgn, int *vicfpn);
+int free_pcb_memph(struct pcb_t *caller);
+int pg_unmap_page(struct pcb_t *caller, int pgn);
+int mm_rss(struct mm_struct *mm);
+
+/* Free space of the memory areas */
+int freerg_insert(struct vm_area_struct *vma, unsigned long start, unsigned long end,
+                  struct vm_rg_struct *merged);
+int freerg_remove(struct vm_area_struct *vma, unsigned long start, unsigned long end);
+int freerg_take(struct vm_area_struct *vma, unsigned long size, struct vm_rg_struct *newrg);
+unsigned long freerg_tail(struct vm_area_struct *vma);
+void freerg_copy(struct vm_area_struct *dst, struct vm_area_struct *src);
+void freerg_clear(struct vm_area_struct *vma);
+int freerg_print(struct vm_area_struct *vma);
+int pg_evict_frame(struct memphy_struct *mram, struct mm_struct *mm, int *retfpn);
+int pg_evict_own_frame(struct memphy_struct *mram, struct mm_struct *mm, int *retfpn);
+int pg_swapout_mm(struct memphy_struct *mram, struct mm_struct *mm, int nr);
+
+/* Page replacement scope, evict from every process or only the faulting one */
+extern int mm_repl_global;
+
+/* Allocation maps frames up front (eager) or on first touch (lazy) */
+extern int mm_lazy_alloc;
+
+/* Largest reservation of a VMA break in bytes, a page or less grows exactly */
+extern int mm_sbrk_max;
+int sbrk_report(void);
+
+/* Largest swap-in readahead window in pages, 0 disables readahead */
+extern int mm_ra_max;
+int readahead_report(void);
+
+/* Page replacement policies */
+#define REPL_FIFO   0
+#define REPL_SECOND 1 /* FIFO giving referenced pages a second chance */
+#define REPL_CLOCK  2
+#define REPL_LRU    3 /* aging approximation of LRU */
+extern int mm_repl_policy;
+int repl_parse_policy(const char *name);
+struct framephy_struct *repl_select(struct framephy_struct **head,
+                                    struct framephy_struct **hand,
+                                    int local, struct mm_struct *mm);
+int repl_report(void);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
+int set_vma_by_num(struct mm_struct *mm, int vmaid, struct vm_area_struct *vma);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
+int MEMPHY_nr_free(struct memphy_struct *mp);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
 int MEMPHY_dump(struct memphy_struct * mp);
-// int MEMPHY_remove_usedfp(struct memphy_struct *mp, int fpn);
-// int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *owner);
-// struct framephy_struct* MEMPHY_get_usedfp(struct memphy_struct *mp);
+int MEMPHY_zero_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_zerofp(struct memphy_struct *mp, int *fpn);
+int MEMPHY_init_zero(struct memphy_struct *mp, int nr);
+int MEMPHY_fill_zerofp(struct memphy_struct *mp);
+void MEMPHY_bind_cpu(int cpuid);
+int MEMPHY_get_cpu(void);
+int MEMPHY_init_rmap(struct memphy_struct *mp);
+int MEMPHY_remove_usedfp(struct memphy_struct *mp, int fpn);
+void MEMPHY_unlink_usedfp(struct memphy_struct *mp, struct framephy_struct *fp);
+int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn);
+int MEMPHY_share_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *mm, int pgn);
+int MEMPHY_unshare_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *mm, int pgn);
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int nr, int *fpn);
+int MEMPHY_put_hugefp(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn, int nr);
+int MEMPHY_split_usedfp(struct memphy_struct *mp, struct framephy_struct *fp);
+void MEMPHY_ksm_drop(struct memphy_struct *mp, struct framephy_struct *fp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg, const char *path);
+int MEMPHY_sync_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_advise_frames(struct memphy_struct *mp, int fpn, int nframes);
+/* SWAP manager prototypes */
+int init_swap(struct memphy_struct *mswp, int *prio, int nswp);
+struct memphy_struct *swap_dev(int swptyp);
+int swap_get_slot(int *swptyp, int *swpoff);
+int swap_put_slot(int swptyp, int swpoff);
+int swap_dup_slot(int swptyp, int swpoff);
+int swap_slot_shared(int swptyp, int swpoff);
+void swap_account_pageout(int written);
+int swap_report(void);
+
+/* Compressed swap cache prototypes */
+int init_zswap(long pool_sz);
+int zswap_store(struct memphy_struct *mp, int fpn, int swptyp, int swpoff);
+int zswap_load(struct memphy_struct *mp, int fpn, int swptyp, int swpoff);
+void zswap_invalidate(int swptyp, int swpoff);
+int zswap_report(void);
+
+/* Shared memory prototypes */
+struct shm_segment *shm_get(int key, int size);
+void shm_dup(struct shm_segment *seg);
+void shm_put(struct shm_segment *seg, struct memphy_struct *mram);
+struct vm_area_struct *shm_find_vma(struct mm_struct *mm, int addr);
+void shm_account_fault(int resident);
+int shm_report(void);
+
+/* Background reclaim prototypes */
+extern int mm_kswapd_low;
+extern int mm_kswapd_high;
+int kswapd_balance(struct memphy_struct *mram);
+void kswapd_account_direct(void);
+int kswapd_report(void);
+
+/* Pre-zeroed frame pool, mm_zero_pool frames kept cleared, 0 disables it */
+extern int mm_zero_pool;
+int zero_getfp(struct memphy_struct *mram, int *fpn);
+void zero_frame(struct memphy_struct *mram, int fpn);
+int zero_refill(struct memphy_struct *mram);
+int zero_report(void);
+
+/* Same page merging, mm_ksm_scan frames hashed per time slot, 0 disables it */
+extern int mm_ksm_scan;
+int ksm_scan(struct memphy_struct *mram);
+void ksm_account_unmerge(void);
+int ksm_report(struct memphy_struct *mram);
+
+/* Resident frame limits, mm_rss_max frames per process, 0 for none */
+extern int mm_rss_max;
+int memcg_set_limit(int id, int frames);
+void memcg_attach(struct mm_struct *mm, int id, int rss_max);
+void memcg_fork(struct mm_struct *child, struct mm_struct *parent);
+void memcg_charge(struct mm_struct *mm, int nr);
+void memcg_limit_room(struct mm_struct *mm, int *own, int *group);
+int memcg_room(struct mm_struct *mm);
+void memcg_account_evict(struct mm_struct *mm);
+int memcg_report_mm(int pid, struct mm_struct *mm);
+int memcg_report(void);
+
+/* Page fault frequency control, faults per 100 accesses, mm_pff_high 0 disables it */
+extern int mm_pff_high;
+extern int mm_pff_low;
+void pff_attach(struct mm_struct *mm, int pid);
+void pff_detach(struct mm_struct *mm);
+int pff_balance(struct memphy_struct *mram);
+int pff_report(void);
+
+/* Medium-term scheduler, swap-ins per 100 accesses, mm_swapper_high 0 disables it */
+extern int mm_swapper_high;
+extern int mm_swapper_low;
+extern int mm_swapper_batch;
+void swapper_attach(struct mm_struct *mm);
+void swapper_account(struct mm_struct *mm);
+void swapper_detach(struct mm_struct *mm);
+int swapper_balance(struct memphy_struct *mram);
+int swapper_report(void);
+
+/* Out of memory killer, mm_oom_kill 0 lets the allocations fail */
+extern int mm_oom_kill;
+int oom_kill(struct pcb_t *caller, int nr);
+int oom_report(void);
+
+/* TLB prototypes */
+int tlb_lookup(struct mm_struct *mm, int pgn, int write, int *fpn);
+void tlb_insert(struct mm_struct *mm, int pgn, int fpn, int writable, int huge);
+void tlb_invalidate(struct mm_struct *mm, int pgn);
+void tlb_flush_mm(struct mm_struct *mm);
+void tlb_huge_stat(long *hit, int *reach);
+
+/* Huge pages, mm_huge_pgn base pages mapped by one TLB entry, 0 disables them */
+extern int mm_huge_pgn;
+int huge_map(struct pcb_t *caller, int pgn);
+void huge_account_base(int nr);
+void huge_set_dirty(struct mm_struct *mm, int pgn);
+void huge_split_locked(struct memphy_struct *mram, struct framephy_struct *fp);
+int huge_split(struct memphy_struct *mram, struct mm_struct *mm, int pgn);
+int huge_report(void);
+
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
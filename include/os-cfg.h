@@ -3,9 +3,11 @@
 
 #define MLQ_SCHED 1
 #define MAX_PRIO 140
+#define SLOT_LOCKSTEP 1
 
 #define MM_PAGING
 #define MM_PAGING_HEAP_GODOWN
+#define MM_PTE64
 //#define MM_FIXED_MEMSZ
 //#define VMDBG 1
 //#define MMDBG 1
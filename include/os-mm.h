@@ -1,12 +1,25 @@
 #ifndef OSMM_H
 #define OSMM_H
 
+#include <sys/types.h> /* pthread types, include/sched.h shadows <sched.h> */
+
 #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
-#define PAGING_MAX_SYMTBL_SZ 30
+#define PAGING_SYMTBL_INIT_SZ 32 /* region IDs held before the table grows */
+#define PAGING_MAX_SYMTBL_SZ 65536 /* region IDs of one process */
+
+#define MEMPHY_MAX_CPU 16  /* number of per-CPU free frame magazines */
+#define MEMPHY_MAG_SZ 32   /* frames cached by one magazine */
+#define MEMPHY_MAG_BATCH 16 /* frames moved per refill/drain of a magazine */
+#define TLB_NR_ENTRY 64    /* entries of each per-CPU TLB */
 
 typedef char BYTE;
 typedef uint32_t addr_t;
+#ifdef MM_PTE64
+typedef uint64_t pte_t; /* wide FPN and swap offset fields */
+#else
+typedef uint32_t pte_t; /* legacy layout, 8192 frames at most */
+#endif
 //typedef unsigned int uint32_t;
 
 struct pgn_t{
@@ -26,6 +39,20 @@ struct vm_rg_struct {
    struct vm_rg_struct *rg_next;
 };
 
+/*
+ *  Free range of a memory area, linked in two treaps of the area: by
+ *  address to coalesce with its neighbours and by size for best fit
+ */
+#define FREERG_BY_ADDR 0
+#define FREERG_BY_SIZE 1
+struct vm_freerg_node {
+   unsigned long rg_start;
+   unsigned long rg_end;
+
+   unsigned int prio;
+   struct vm_freerg_node *child[2][2]; /* [FREERG_BY_*][left, right] */
+};
+
 /*
  *  Memory area struct
  */
@@ -35,28 +62,97 @@ struct vm_area_struct {
    unsigned long vm_end;
 
    unsigned long sbrk;
+   unsigned long vm_grow; /* size of the next reservation of the break */
+   unsigned long vm_used; /* end of the highest region ever allocated */
 /*
  * Derived field
  * unsigned long vm_limit = vm_end - vm_start
  */
    struct mm_struct *vm_mm;
-   struct vm_rg_struct *vm_freerg_list;
+   struct vm_freerg_node *vm_freerg[2]; /* free space, roots by FREERG_BY_* */
    struct vm_area_struct *vm_next;
+   struct shm_segment *vm_shm; /* segment attached here, NULL if private */
 };
 
 /* 
  * Memory management struct
  */
+/*
+ * Group of processes sharing a limit on resident MEMRAM frames, the
+ * processes of one priority and their forks form a group
+ */
+struct mem_cgroup {
+   int id;
+   int limit; /* frames, 0 if the group has no limit */
+   int usage; /* frames charged to its processes, under fp_lock */
+   int peak;
+   int nproc; /* processes attached so far */
+   long evict; /* pages its processes evicted for going over a limit */
+};
+
 struct mm_struct {
-   uint32_t *pgd;
+   pte_t *pgd;
 
    struct vm_area_struct *mmap;
+   /* VMAs indexed by vm_id, NULL for an unused ID */
+   struct vm_area_struct **vmatbl;
+   int vmatbl_sz;
+
+   /* Symbol table indexed by region ID, grown on demand */
+   struct vm_rg_struct *symrgtbl;
+   int symrgtbl_sz;
+
+   /* Frames mapped by this mm, circular newest first (local replacement) */
+   struct framephy_struct *resident;
+   struct framephy_struct *clock_hand;
+
+   /* Serialize the owner against CPUs evicting its pages */
+   pthread_mutex_t lock;
+
+   /* TLB statistics of the process */
+   int tlb_hit;
+   int tlb_miss;
+   int pgfault; /* accesses that found their page out of MEMRAM */
+   int pgretry; /* time slots the current access waited for a frame */
+   int pgzero;  /* faults mapping a zero filled frame (lazy allocation) */
+   int cowfault; /* writes copying a frame shared after fork */
+
+   /* Swap-in readahead state */
+   int ra_next; /* page a sequential fault would hit next */
+   int ra_win;  /* pages read ahead by the next sequential fault */
+
+   /* Resident limits, frames owned in MEMRAM are charged under fp_lock */
+   struct mem_cgroup *memcg; /* NULL for a segment anchor */
+   int rss_charged;
+   int rss_peak;
+   int rss_max;   /* frames, 0 if the process has no limit of its own */
+   int rss_pff;   /* budget of the fault frequency controller, 0 if none */
+   int rss_evict; /* own pages evicted for going over a limit */
+
+   /* Counters already folded into the rate of the swapper */
+   int swapper_fault;
+   int swapper_access;
+};
 
-   /* Currently we support a fixed number of symbol */
-   struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
+/*
+ * Shared memory segment, its frames are owned by the anchor mm and
+ * every attached process maps them as an extra mapper
+ */
+struct shm_segment {
+   int key;
+   int npages;
+   int nattach;            /* processes attached, the segment goes at 0 */
+   struct mm_struct mm;    /* anchor, pgd indexed by page of the segment */
+   struct shm_segment *next;
+};
 
-   /* list of free page */
-   struct pgn_t *fifo_pgn;
+/*
+ * Extra mapping of a frame shared after fork or through a segment
+ */
+struct frame_map {
+   struct mm_struct *mm;
+   int pgn;
+   struct frame_map *next;
 };
 
 /*
@@ -65,27 +161,86 @@ struct mm_struct {
 struct framephy_struct { 
    int fpn;
    struct framephy_struct *fp_next;
+   struct framephy_struct *fp_prev; /* used list is doubly linked */
 
    /* Resereed for tracking allocated framed */
    struct mm_struct* owner;
+   int pgn; /* page mapped by owner */
+   struct framephy_struct *mm_next; /* ring of the frames of owner */
+   struct framephy_struct *mm_prev;
+   int mapcount;            /* PTEs mapping the frame, owner included */
+   struct frame_map *maps;  /* mappers other than owner */
+   unsigned char age; /* aging LRU history, MSB is the latest period */
+   unsigned char ra;  /* read ahead, not accessed by its owner yet */
+   int huge;          /* frames of the huge page this frame heads, 0 if none */
+   int ksm;           /* merged by content, shared by unrelated pages */
    
    
   /* In RAM or not */
    int in_RAM;
+   int swptyp; /* swap device of a frame not in RAM */
+   int swpoff; /* MEMRAM: swap slot still holding the page, -1 if none */
+};
+
+/*
+ * Per-CPU cache of free frames, a CPU only takes the shared
+ * pool lock once per MEMPHY_MAG_BATCH frames
+ */
+struct memphy_mag {
+   pthread_mutex_t lock; /* uncontended unless another CPU steals */
+   int cnt;
+   int fpn[MEMPHY_MAG_SZ];
 };
 
 struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
    int maxsz;
+   int fd; /* backing file of a mmap-ed storage, -1 if in host RAM */
    
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
+   pthread_mutex_t csr_lock;
 
    /* Management structure */
    struct framephy_struct *free_fp_list;
-   struct framephy_struct *used_fp_list;
+   int nr_free; /* free frames, pooled or cached in magazines */
+   struct framephy_struct *used_fp_list; /* circular, newest first */
+   struct framephy_struct *clock_hand;   /* CLOCK position in used_fp_list */
+   pthread_mutex_t fp_lock; /* protect the shared frame lists */
+
+   /* Reverse map FPN -> (owner, pgn), linked in used_fp_list if mapped */
+   struct framephy_struct *frmtbl;
+   /* Bit per frame in the shared pool or a magazine, MEMRAM only */
+   unsigned long *free_map;
+
+   struct memphy_mag mag[MEMPHY_MAX_CPU];
+
+   /* Free frames already cleared, counted in nr_free too */
+   pthread_mutex_t zero_lock;
+   int *zero_fpn;
+   int zero_cnt;
+   int zero_sz; /* pool capacity, 0 if there is no pool */
+
+   /* Frames saved by merging pages of equal content, under fp_lock */
+   int ksm_saved;
+   int ksm_peak;
+};
+
+/*
+ * Swap device registered to the swap manager
+ */
+struct swap_info_struct {
+   int type;   /* device index, stored in the PTE SWPTYP field */
+   int prio;   /* higher tiers are used first, equal prio are striped */
+   struct memphy_struct *mp;
+
+   int nframes;
+   int inuse;
+   int peak;
+   int nr_out; /* number of slots handed out */
+   unsigned short *slot_ref; /* PTEs and frames referring to each slot */
 };
 
 #endif
@@ -15,6 +15,8 @@ void enqueue(struct queue_t * q, struct pcb_t * proc);
 
 struct pcb_t * dequeue(struct queue_t * q);
 
+struct pcb_t * remove_at(struct queue_t * q, int index);
+
 int empty(struct queue_t * q);
 
 #endif
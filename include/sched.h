@@ -23,6 +23,15 @@ void put_proc(struct pcb_t * proc);
 /* Add a new process to ready queue */
 void add_proc(struct pcb_t * proc);
 
+/* Take the best victim among ready processes out of scheduling */
+struct pcb_t * suspend_proc(int (*better)(struct pcb_t *, struct pcb_t *));
+
+/* Put the longest suspended process back to ready queue */
+struct pcb_t * resume_proc(void);
+
+/* Take a ready process a better victim than another out of scheduling */
+struct pcb_t * take_proc(int (*better)(struct pcb_t *, struct pcb_t *), struct pcb_t * than);
+
 #endif
 
 
@@ -7,6 +7,7 @@
 struct timer_id_t {
 	int done;
 	int fsh;
+	int turn; /* may run its job in the current slot, SLOT_LOCKSTEP */
 	pthread_cond_t event_cond;
 	pthread_mutex_t event_lock;
 	pthread_cond_t timer_cond;
@@ -21,6 +22,8 @@ struct timer_id_t * attach_event();
 
 void detach_event(struct timer_id_t * event);
 
+void enter_slot(struct timer_id_t* timer_id);
+
 void next_slot(struct timer_id_t* timer_id);
 
 uint64_t current_time();
@@ -2,6 +2,10 @@
 #include "cpu.h"
 #include "mem.h"
 #include "mm.h"
+#include "loader.h"
+#include "sched.h"
+#include <stdio.h>
+#include <stdlib.h>
 
 int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -45,6 +49,21 @@ int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
+#ifdef MM_PAGING
+int fork_proc(struct pcb_t * proc, uint32_t child_pc) {
+	struct pcb_t * child = clone_proc(proc);
+	child->pc = (child_pc < proc->code->size) ? child_pc : proc->pc;
+	if (pgfork(proc, child)) {
+		free(child->page_table);
+		free(child);
+		return 1;
+	}
+	printf("\tPID %2d forked process %2d\n", proc->pid, child->pid);
+	add_proc(child);
+	return 0;
+}
+#endif
+
 int run(struct pcb_t * proc) {
 	/* Check if Program Counter point to the proper instruction */
 	if (proc->pc >= proc->code->size) {
@@ -70,6 +89,15 @@ int run(struct pcb_t * proc) {
 	case MALLOC:
 		stat = pgmalloc(proc, ins.arg_0, ins.arg_1);
 		break;
+	case FORK:
+		stat = fork_proc(proc, ins.arg_0);
+		break;
+	case SHMAT:
+		stat = pgshmat(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+		break;
+	case SHMDT:
+		stat = pgshmdt(proc, ins.arg_0);
+		break;
 #endif
 	case FREE:
 #ifdef MM_PAGING
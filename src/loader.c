@@ -13,6 +13,9 @@ static uint32_t avail_pid = 1;
 #define OPT_WRITE	"write"
 #ifdef MM_PAGING
 #define OPT_MALLOC	"malloc"
+#define OPT_FORK	"fork"
+#define OPT_SHMAT	"shmat"
+#define OPT_SHMDT	"shmdt"
 #endif
 
 static enum ins_opcode_t get_opcode(char * opt) {
@@ -23,6 +26,12 @@ static enum ins_opcode_t get_opcode(char * opt) {
 #ifdef MM_PAGING
 	}else if (!strcmp(opt, OPT_MALLOC)) {
 		return MALLOC;
+	}else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
+	}else if (!strcmp(opt, OPT_SHMAT)) {
+		return SHMAT;
+	}else if (!strcmp(opt, OPT_SHMDT)) {
+		return SHMDT;
 #endif
 	}else if (!strcmp(opt, OPT_FREE)) {
 		return FREE;
@@ -39,8 +48,8 @@ static enum ins_opcode_t get_opcode(char * opt) {
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
 	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	/* Forks take PIDs from the CPUs at the same time */
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
 	proc->page_table =
 		(struct page_table_t*)malloc(sizeof(struct page_table_t));
 	proc->bp = PAGE_SIZE;
@@ -65,6 +74,25 @@ struct pcb_t * load(const char * path) {
 		switch(proc->code->text[i].opcode) {
 		case CALC:
 			break;
+#ifdef MM_PAGING
+		case FORK:
+			/* Instruction the child starts from */
+			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			break;
+		case SHMAT:
+			/* Segment key, size and region bound to it */
+			fscanf(
+				file,
+				"%u %u %u\n",
+				&proc->code->text[i].arg_0,
+				&proc->code->text[i].arg_1,
+				&proc->code->text[i].arg_2
+			);
+			break;
+		case SHMDT:
+			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			break;
+#endif
 		case ALLOC:
 			fscanf(
 				file,
@@ -101,4 +129,16 @@ struct pcb_t * load(const char * path) {
 		}
 	}
 	return proc;
-}
\ No newline at end of file
+}
+
+struct pcb_t * clone_proc(struct pcb_t * parent) {
+	/* The child runs the same code, the caller sets where it starts */
+	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	memcpy(proc, parent, sizeof(struct pcb_t));
+	/* The loader and the other CPUs take PIDs at the same time */
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	proc->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	memcpy(proc->page_table, parent->page_table, sizeof(struct page_table_t));
+	return proc;
+}
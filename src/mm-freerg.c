@@ -0,0 +1,328 @@
+/*
+ * PAGING based Memory Management
+ * Free space of the memory areas mm/mm-freerg.c
+ *
+ * Each VMA keeps its free ranges as nodes linked in two treaps. The
+ * address treap finds the neighbours of a freed range so adjacent free
+ * space is always merged, the size treap gives the best fit of an
+ * allocation. Both searches and updates are O(log n) in the number of
+ * free ranges. Nodes belong to the VMA, callers only pass bounds.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef MM_PAGING
+#define FREERG_LEN(n) ((n)->rg_end - (n)->rg_start)
+
+/*
+ *  freerg_before - check if a node sorts before a key in a treap
+ *  @t: FREERG_BY_ADDR or FREERG_BY_SIZE
+ *  Sizes tie on the address, so every key is unique in both treaps
+ */
+static int freerg_before(int t, struct vm_freerg_node *n,
+                         unsigned long start, unsigned long len)
+{
+  if (t == FREERG_BY_SIZE && FREERG_LEN(n) != len)
+    return FREERG_LEN(n) < len;
+
+  return n->rg_start < start;
+}
+
+static void freerg_split(int t, struct vm_freerg_node *n,
+                         unsigned long start, unsigned long len,
+                         struct vm_freerg_node **l, struct vm_freerg_node **r)
+{
+  if (n == NULL)
+  {
+    *l = *r = NULL;
+    return;
+  }
+
+  if (freerg_before(t, n, start, len))
+  {
+    *l = n;
+    freerg_split(t, n->child[t][1], start, len, &n->child[t][1], r);
+  }
+  else
+  {
+    *r = n;
+    freerg_split(t, n->child[t][0], start, len, l, &n->child[t][0]);
+  }
+}
+
+static struct vm_freerg_node *freerg_merge(int t, struct vm_freerg_node *l,
+                                           struct vm_freerg_node *r)
+{
+  if (l == NULL)
+    return r;
+  if (r == NULL)
+    return l;
+
+  if (l->prio > r->prio)
+  {
+    l->child[t][1] = freerg_merge(t, l->child[t][1], r);
+    return l;
+  }
+
+  r->child[t][0] = freerg_merge(t, l, r->child[t][0]);
+  return r;
+}
+
+static void freerg_link(int t, struct vm_freerg_node **root, struct vm_freerg_node *n)
+{
+  while (*root != NULL && (*root)->prio > n->prio)
+    root = &(*root)->child[t][freerg_before(t, *root, n->rg_start, FREERG_LEN(n))];
+
+  freerg_split(t, *root, n->rg_start, FREERG_LEN(n), &n->child[t][0], &n->child[t][1]);
+  *root = n;
+}
+
+static void freerg_unlink(int t, struct vm_freerg_node **root, struct vm_freerg_node *n)
+{
+  while (*root != n)
+    root = &(*root)->child[t][freerg_before(t, *root, n->rg_start, FREERG_LEN(n))];
+
+  *root = freerg_merge(t, n->child[t][0], n->child[t][1]);
+}
+
+/*
+ *  freerg_add - put a new node for [start, end) in both treaps
+ */
+static void freerg_add(struct vm_area_struct *vma, unsigned long start, unsigned long end)
+{
+  struct vm_freerg_node *n = malloc(sizeof(struct vm_freerg_node));
+  uint32_t h = (uint32_t)start * 0x9e3779b1u ^ (uint32_t)(uintptr_t)n;
+
+  /* Any well spread priority keeps the treaps balanced */
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+
+  n->rg_start = start;
+  n->rg_end = end;
+  n->prio = h;
+  freerg_link(FREERG_BY_ADDR, &vma->vm_freerg[FREERG_BY_ADDR], n);
+  freerg_link(FREERG_BY_SIZE, &vma->vm_freerg[FREERG_BY_SIZE], n);
+}
+
+static void freerg_del(struct vm_area_struct *vma, struct vm_freerg_node *n)
+{
+  freerg_unlink(FREERG_BY_ADDR, &vma->vm_freerg[FREERG_BY_ADDR], n);
+  freerg_unlink(FREERG_BY_SIZE, &vma->vm_freerg[FREERG_BY_SIZE], n);
+  free(n);
+}
+
+/*
+ *  freerg_insert - give a range back to the free space of a VMA
+ *  @vma: memory area
+ *  @start, @end: freed range
+ *  @merged: return the free range it ended up in, may be NULL
+ *  The range is merged with the free ranges right before and after it
+ *  Return 0, -1 if the range is empty or already partly free
+ */
+int freerg_insert(struct vm_area_struct *vma, unsigned long start, unsigned long end,
+                  struct vm_rg_struct *merged)
+{
+  struct vm_freerg_node *n, *prev = NULL, *next = NULL;
+
+  if (start >= end)
+    return -1;
+
+  for (n = vma->vm_freerg[FREERG_BY_ADDR]; n != NULL; )
+    if (n->rg_start < start)
+    {
+      prev = n;
+      n = n->child[FREERG_BY_ADDR][1];
+    }
+    else
+    {
+      next = n;
+      n = n->child[FREERG_BY_ADDR][0];
+    }
+
+  if ((prev != NULL && prev->rg_end > start) || (next != NULL && next->rg_start < end))
+    return -1;
+
+  if (prev != NULL && prev->rg_end == start)
+  {
+    start = prev->rg_start;
+    freerg_del(vma, prev);
+  }
+  if (next != NULL && next->rg_start == end)
+  {
+    end = next->rg_end;
+    freerg_del(vma, next);
+  }
+
+  freerg_add(vma, start, end);
+  if (merged != NULL)
+  {
+    merged->rg_start = start;
+    merged->rg_end = end;
+    merged->vmaid = vma->vm_id;
+    merged->rg_next = NULL;
+  }
+
+  return 0;
+}
+
+/*
+ *  freerg_remove - take a range back out of the free space of a VMA
+ *  @vma: memory area
+ *  @start, @end: range inside a single free range
+ *  Return 0, -1 if the range is not free
+ */
+int freerg_remove(struct vm_area_struct *vma, unsigned long start, unsigned long end)
+{
+  struct vm_freerg_node *n, *in = NULL;
+  unsigned long rg_start, rg_end;
+
+  for (n = vma->vm_freerg[FREERG_BY_ADDR]; n != NULL; )
+    if (n->rg_start <= start)
+    {
+      in = n;
+      n = n->child[FREERG_BY_ADDR][1];
+    }
+    else
+      n = n->child[FREERG_BY_ADDR][0];
+
+  if (in == NULL || start >= end || in->rg_end < end)
+    return -1;
+
+  rg_start = in->rg_start;
+  rg_end = in->rg_end;
+  freerg_del(vma, in);
+  if (rg_start < start)
+    freerg_add(vma, rg_start, start);
+  if (end < rg_end)
+    freerg_add(vma, end, rg_end);
+
+  return 0;
+}
+
+/*
+ *  freerg_take - carve an allocation out of the free space of a VMA
+ *  @vma: memory area
+ *  @size: bytes needed
+ *  @newrg: return the allocated range
+ *  The smallest free range holding size is used, lowest address first,
+ *  and what it has left stays free
+ *  Return 0, -1 if no free range is large enough
+ */
+int freerg_take(struct vm_area_struct *vma, unsigned long size, struct vm_rg_struct *newrg)
+{
+  struct vm_freerg_node *n, *fit = NULL;
+  unsigned long start, end;
+
+  for (n = vma->vm_freerg[FREERG_BY_SIZE]; n != NULL; )
+    if (freerg_before(FREERG_BY_SIZE, n, 0, size))
+      n = n->child[FREERG_BY_SIZE][1];
+    else
+    {
+      fit = n;
+      n = n->child[FREERG_BY_SIZE][0];
+    }
+
+  if (fit == NULL)
+    return -1;
+
+  start = fit->rg_start;
+  end = fit->rg_end;
+  freerg_del(vma, fit);
+  if (start + size < end)
+    freerg_add(vma, start + size, end);
+
+  newrg->rg_start = start;
+  newrg->rg_end = start + size;
+  newrg->vmaid = vma->vm_id;
+  newrg->rg_next = NULL;
+
+  return 0;
+}
+
+/*
+ *  freerg_tail - get the free bytes right below the break of a VMA
+ *  Growing the area only has to cover what they miss
+ */
+unsigned long freerg_tail(struct vm_area_struct *vma)
+{
+  struct vm_freerg_node *n = vma->vm_freerg[FREERG_BY_ADDR];
+
+  if (n == NULL)
+    return 0;
+
+  while (n->child[FREERG_BY_ADDR][1] != NULL)
+    n = n->child[FREERG_BY_ADDR][1];
+
+  return (n->rg_end == vma->sbrk) ? FREERG_LEN(n) : 0;
+}
+
+static void freerg_copy_nodes(struct vm_area_struct *dst, struct vm_freerg_node *n)
+{
+  if (n == NULL)
+    return;
+
+  freerg_copy_nodes(dst, n->child[FREERG_BY_ADDR][0]);
+  freerg_add(dst, n->rg_start, n->rg_end);
+  freerg_copy_nodes(dst, n->child[FREERG_BY_ADDR][1]);
+}
+
+/*
+ *  freerg_copy - give a forked VMA its own copy of the free space
+ */
+void freerg_copy(struct vm_area_struct *dst, struct vm_area_struct *src)
+{
+  dst->vm_freerg[FREERG_BY_ADDR] = dst->vm_freerg[FREERG_BY_SIZE] = NULL;
+  freerg_copy_nodes(dst, src->vm_freerg[FREERG_BY_ADDR]);
+}
+
+static void freerg_free_nodes(struct vm_freerg_node *n)
+{
+  if (n == NULL)
+    return;
+
+  freerg_free_nodes(n->child[FREERG_BY_ADDR][0]);
+  freerg_free_nodes(n->child[FREERG_BY_ADDR][1]);
+  free(n);
+}
+
+/*
+ *  freerg_clear - release every free range node of a VMA
+ */
+void freerg_clear(struct vm_area_struct *vma)
+{
+  freerg_free_nodes(vma->vm_freerg[FREERG_BY_ADDR]);
+  vma->vm_freerg[FREERG_BY_ADDR] = vma->vm_freerg[FREERG_BY_SIZE] = NULL;
+}
+
+static void freerg_print_nodes(struct vm_freerg_node *n, int vmaid)
+{
+  if (n == NULL)
+    return;
+
+  freerg_print_nodes(n->child[FREERG_BY_ADDR][0], vmaid);
+  printf("rg[%ld->%ld<at>vma=%d]\n", n->rg_start, n->rg_end, vmaid);
+  freerg_print_nodes(n->child[FREERG_BY_ADDR][1], vmaid);
+}
+
+/*
+ *  freerg_print - list the free ranges of a VMA in address order
+ */
+int freerg_print(struct vm_area_struct *vma)
+{
+  printf("print_freerg: ");
+  if (vma->vm_freerg[FREERG_BY_ADDR] == NULL)
+  {
+    printf("NULL list\n");
+    return -1;
+  }
+  printf("\n");
+  freerg_print_nodes(vma->vm_freerg[FREERG_BY_ADDR], vma->vm_id);
+  printf("\n");
+
+  return 0;
+}
+#endif
@@ -0,0 +1,153 @@
+/*
+ * PAGING based Memory Management
+ * Huge pages mm/mm-huge.c
+ *
+ * An eager allocation covering an aligned span of mm_huge_pgn pages
+ * maps it on as many contiguous frames, aligned the same way, so that
+ * a single TLB entry translates the whole span. Every PTE of the span
+ * is kept and marked huge, the page table walk is unchanged. The head
+ * frame stands for the huge page on the used lists, replacement and
+ * any partial unmap or copy-on-write share split it back into base
+ * pages. Allocations MEMRAM cannot serve contiguously fall back to
+ * base pages.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+int mm_huge_pgn = 0;
+
+/* Statistics */
+static long huge_nr_map, huge_nr_split, huge_nr_fallback;
+static long huge_nr_base; /* eager pages mapped as base pages */
+
+/*
+ *  huge_map - map an aligned span of pages as one huge page
+ *  @caller: caller, its mm is locked
+ *  @pgn: first page, aligned on mm_huge_pgn
+ *  Return 0 on success, -1 if MEMRAM has no free aligned run
+ */
+int huge_map(struct pcb_t *caller, int pgn)
+{
+  pte_t *pte;
+  int fpn, i;
+
+  if (MEMPHY_get_freefp_range(caller->mram, mm_huge_pgn, &fpn) < 0)
+  {
+    __atomic_fetch_add(&huge_nr_fallback, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* Clean like base pages, the first write dirties all of them */
+  for (i = 0; i < mm_huge_pgn; i++)
+  {
+    zero_frame(caller->mram, fpn + i);
+    pte = &caller->mm->pgd[pgn + i];
+    pte_set_fpn(pte, fpn + i);
+    SETBIT(*pte, PAGING_PTE_HUGE_MASK);
+  }
+  MEMPHY_put_hugefp(caller->mram, fpn, caller->mm, pgn, mm_huge_pgn);
+
+  __atomic_fetch_add(&huge_nr_map, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ *  huge_set_dirty - mark every page of a huge page dirty
+ *  @mm: owner, locked by the caller
+ *  @pgn: any page of the huge page
+ */
+void huge_set_dirty(struct mm_struct *mm, int pgn)
+{
+  int i;
+
+  pgn &= ~(mm_huge_pgn - 1);
+  for (i = 0; i < mm_huge_pgn; i++)
+    pte_set_dirty(&mm->pgd[pgn + i]);
+}
+
+/*
+ *  huge_account_base - count eager pages that were mapped as base pages
+ */
+void huge_account_base(int nr)
+{
+  __atomic_fetch_add(&huge_nr_base, nr, __ATOMIC_RELAXED);
+}
+
+/*
+ *  huge_split_locked - break a huge page into base pages
+ *  @mram: MEMRAM
+ *  @fp: head frame of the huge page
+ *  Caller holds the fp_lock of MEMRAM and the lock of the owner
+ */
+void huge_split_locked(struct memphy_struct *mram, struct framephy_struct *fp)
+{
+  struct mm_struct *mm = fp->owner;
+  int pgn = fp->pgn, nr, i;
+
+  nr = MEMPHY_split_usedfp(mram, fp);
+
+  /* Replacement may clear a referenced bit meanwhile */
+  for (i = 0; i < nr; i++)
+    __atomic_fetch_and(&mm->pgd[pgn + i], ~PAGING_PTE_HUGE_MASK, __ATOMIC_RELAXED);
+  tlb_invalidate(mm, pgn);
+
+  __atomic_fetch_add(&huge_nr_split, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  huge_split - break up the huge page a page belongs to
+ *  @mram: MEMRAM
+ *  @mm: owner of the page, locked by the caller
+ *  @pgn: any page of the huge page
+ *  Return 1 if the page was part of a huge page
+ */
+int huge_split(struct memphy_struct *mram, struct mm_struct *mm, int pgn)
+{
+  pte_t pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+  struct framephy_struct *fp;
+
+  if (!PAGING_PTE_PAGE_PRESENT(pte) || (pte & PAGING_PTE_SWAPPED_MASK) ||
+      !(pte & PAGING_PTE_HUGE_MASK))
+    return 0;
+
+  fp = &mram->frmtbl[PAGING_PTE_FPN(pte) & ~(mm_huge_pgn - 1)];
+
+  pthread_mutex_lock(&mram->fp_lock);
+  huge_split_locked(mram, fp);
+  pthread_mutex_unlock(&mram->fp_lock);
+
+  return 1;
+}
+
+/*
+ *  huge_report - print huge page coverage and TLB reach
+ */
+int huge_report(void)
+{
+  long nr_huge = huge_nr_map * mm_huge_pgn;
+  long hit;
+  int reach;
+
+  if (mm_huge_pgn == 0)
+    return 0;
+
+  tlb_huge_stat(&hit, &reach);
+
+  printf("----------------HUGE PAGES-------------- \n");
+  printf("huge page=%d pages (%d bytes) mapped=%ld split=%ld fallback=%ld\n",
+         mm_huge_pgn, mm_huge_pgn * PAGING_PAGESZ, huge_nr_map, huge_nr_split,
+         huge_nr_fallback);
+  printf("coverage=%.2f%% (%ld of %ld eager pages mapped huge)\n",
+         (nr_huge + huge_nr_base) ? 100.0 * nr_huge / (nr_huge + huge_nr_base) : 0.0,
+         nr_huge, nr_huge + huge_nr_base);
+  printf("TLB hits through huge entries=%ld reach peak=%d pages per CPU (%ld bytes), "
+         "at most %d with base pages only\n",
+         hit, reach, (long)reach * PAGING_PAGESZ, TLB_NR_ENTRY);
+
+  return 0;
+}
+#endif
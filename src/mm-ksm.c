@@ -0,0 +1,306 @@
+/*
+ * PAGING based Memory Management
+ * Same page merging mm/mm-ksm.c
+ *
+ * A scanner runs once per time slot next to the CPUs and hashes the
+ * content of mm_ksm_scan MEMRAM frames, resuming where it stopped. A
+ * frame whose hash was seen on another frame is compared with it byte
+ * per byte and, when equal, its page is remapped read-only on the
+ * other frame and the frame is freed. Merged frames are shared like
+ * frames after fork, copy-on-write, so a write unmerges the page.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+#define KSM_NR_BUCKET 1024
+
+int mm_ksm_scan = 0; /* 0 keeps the scanner off */
+
+/* Last frame seen with a content hash, checked again before merging */
+struct ksm_entry {
+  unsigned long long hash;
+  int fpn; /* -1 if the bucket is empty */
+};
+
+/* Only used by the scanner thread */
+static struct ksm_entry ksm_tbl[KSM_NR_BUCKET];
+static int ksm_tbl_init;
+static int ksm_cursor;
+
+/* Statistics */
+static long ksm_nr_scan, ksm_nr_merge, ksm_nr_busy, ksm_nr_stale;
+static long ksm_nr_unmerge;
+
+/*
+ *  ksm_hash - FNV-1a hash of the content of a frame
+ */
+static unsigned long long ksm_hash(struct memphy_struct *mram, int fpn)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  BYTE *page = mram->storage + (long)fpn * PAGING_PAGESZ;
+  int i;
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+  {
+    h ^= (unsigned char)page[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+/*
+ *  ksm_same - compare the content of two frames
+ */
+static int ksm_same(struct memphy_struct *mram, int fpn1, int fpn2)
+{
+  BYTE *p1 = mram->storage + (long)fpn1 * PAGING_PAGESZ;
+  BYTE *p2 = mram->storage + (long)fpn2 * PAGING_PAGESZ;
+  int i;
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+    if (p1[i] != p2[i])
+      return 0;
+
+  return 1;
+}
+
+/*
+ *  ksm_mergeable - check a frame maps plain process pages
+ *  Caller holds the fp_lock of MEMRAM. Huge pages and the anchor of a
+ *  shared memory segment, which has no memory area, are left alone
+ */
+static int ksm_mergeable(struct framephy_struct *fp)
+{
+  return fp->fp_next != NULL && fp->huge == 0 && fp->owner->mmap != NULL;
+}
+
+/*
+ *  ksm_release_upto - unlock the mappers of a frame taken by ksm_grab
+ *  @upto: first extra mapping left unlocked, NULL for all of them
+ *  Caller holds the fp_lock of MEMRAM, the frame stays mapped and a
+ *  mapper unlocked first may drop its mapping meanwhile
+ */
+static void ksm_release_upto(struct framephy_struct *fp, struct mm_struct *held,
+                             struct frame_map *upto)
+{
+  struct frame_map *map;
+
+  if (fp->owner != held)
+    pthread_mutex_unlock(&fp->owner->lock);
+
+  for (map = fp->maps; map != upto; map = map->next)
+    if (map->mm != held)
+      pthread_mutex_unlock(&map->mm->lock);
+}
+
+/*
+ *  ksm_grab - lock every mapper of a frame
+ *  @held: mm the scanner already locked, NULL if none
+ *  Caller holds the fp_lock of MEMRAM. A mapper busy on a CPU makes
+ *  the frame skipped, like the replacement policies do
+ */
+static int ksm_grab(struct framephy_struct *fp, struct mm_struct *held)
+{
+  struct frame_map *map;
+
+  if (fp->owner != held && pthread_mutex_trylock(&fp->owner->lock) != 0)
+    return 0;
+
+  for (map = fp->maps; map != NULL; map = map->next)
+    if (map->mm != held && pthread_mutex_trylock(&map->mm->lock) != 0)
+    {
+      ksm_release_upto(fp, held, map);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ *  ksm_maps - check the owner PTE of a frame still maps it in MEMRAM
+ */
+static int ksm_maps(struct framephy_struct *fp)
+{
+  pte_t pte = __atomic_load_n(&fp->owner->pgd[fp->pgn], __ATOMIC_RELAXED);
+
+  return PAGING_PTE_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_SWAPPED_MASK) &&
+         !(pte & PAGING_PTE_HUGE_MASK) && (int)PAGING_PTE_FPN(pte) == fp->fpn;
+}
+
+/*
+ *  ksm_merge_into - remap a private page on a frame of equal content
+ *  @mram: MEMRAM
+ *  @mm, @pgn: page, its frame is freed
+ *  @efp: frame kept, every mapper of it and mm are locked
+ */
+static void ksm_merge_into(struct memphy_struct *mram, struct mm_struct *mm, int pgn,
+                           struct framephy_struct *efp)
+{
+  struct framephy_struct *fp;
+  struct frame_map *map;
+  pte_t pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+
+  /* Every mapper of the kept frame must copy it before writing */
+  pte_set_cow(&efp->owner->pgd[efp->pgn]);
+  tlb_invalidate(efp->owner, efp->pgn);
+  for (map = efp->maps; map != NULL; map = map->next)
+  {
+    pte_set_cow(&map->mm->pgd[map->pgn]);
+    tlb_invalidate(map->mm, map->pgn);
+  }
+  efp->ksm = 1;
+
+  fp = &mram->frmtbl[PAGING_PTE_FPN(pte)];
+  if (MEMPHY_unshare_usedfp(mram, fp->fpn, mm, pgn) == 0)
+  {
+    if (fp->swpoff >= 0)
+    {
+      swap_put_slot(fp->swptyp, fp->swpoff);
+      fp->swpoff = -1;
+    }
+    MEMPHY_put_freefp(mram, fp->fpn);
+  }
+
+  pte_set_fpn(&mm->pgd[pgn], efp->fpn);
+  pte_set_cow(&mm->pgd[pgn]);
+  if (pte & PAGING_PTE_DIRTY_MASK)
+    pte_set_dirty(&mm->pgd[pgn]);
+  MEMPHY_share_usedfp(mram, efp->fpn, mm, pgn);
+  tlb_invalidate(mm, pgn);
+}
+
+/*
+ *  ksm_scan_frame - hash a frame and merge it with an equal one
+ *  Return 1 if the page of the frame was merged
+ */
+static int ksm_scan_frame(struct memphy_struct *mram, struct framephy_struct *fp)
+{
+  struct framephy_struct *efp;
+  struct ksm_entry *ke;
+  struct mm_struct *mm;
+  unsigned long long h;
+  int pgn, ok, ret = 0;
+
+  /* Only private pages are merged, a merged frame is not scanned again */
+  pthread_mutex_lock(&mram->fp_lock);
+  if (!ksm_mergeable(fp) || fp->mapcount != 1 || fp->maps != NULL)
+  {
+    pthread_mutex_unlock(&mram->fp_lock);
+    return 0;
+  }
+  mm = fp->owner;
+  pgn = fp->pgn;
+  ok = (pthread_mutex_trylock(&mm->lock) == 0);
+  pthread_mutex_unlock(&mram->fp_lock);
+
+  if (!ok)
+  {
+    ksm_nr_busy++;
+    return 0;
+  }
+
+  if (!ksm_maps(fp) ||
+      (__atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED) & PAGING_PTE_COW_MASK))
+  {
+    pthread_mutex_unlock(&mm->lock);
+    return 0;
+  }
+
+  h = ksm_hash(mram, fp->fpn);
+  ke = &ksm_tbl[h % KSM_NR_BUCKET];
+
+  if (ke->fpn >= 0 && ke->fpn != fp->fpn && ke->hash == h)
+  {
+    efp = &mram->frmtbl[ke->fpn];
+
+    /* The frame seen before may have been freed or rewritten since */
+    pthread_mutex_lock(&mram->fp_lock);
+    ok = ksm_mergeable(efp) && (efp->mapcount == 1 || efp->ksm) && ksm_grab(efp, mm);
+    pthread_mutex_unlock(&mram->fp_lock);
+
+    if (ok)
+    {
+      if (ksm_maps(efp) && ksm_same(mram, fp->fpn, efp->fpn))
+      {
+        ksm_merge_into(mram, mm, pgn, efp);
+        ret = 1;
+      }
+      else
+        ksm_nr_stale++;
+      pthread_mutex_lock(&mram->fp_lock);
+      ksm_release_upto(efp, mm, NULL);
+      pthread_mutex_unlock(&mram->fp_lock);
+    }
+    else
+      ksm_nr_busy++;
+  }
+
+  if (!ret)
+  {
+    ke->hash = h;
+    ke->fpn = fp->fpn;
+  }
+
+  pthread_mutex_unlock(&mm->lock);
+  return ret;
+}
+
+/*
+ *  ksm_scan - run the scanner over the next mm_ksm_scan frames
+ *  @mram: MEMRAM
+ *  Called by the scanner thread once per time slot
+ *  Return the number of pages merged
+ */
+int ksm_scan(struct memphy_struct *mram)
+{
+  int numfp = mram->maxsz / PAGING_PAGESZ;
+  int i, nr = 0;
+
+  if (!ksm_tbl_init)
+  {
+    for (i = 0; i < KSM_NR_BUCKET; i++)
+      ksm_tbl[i].fpn = -1;
+    ksm_tbl_init = 1;
+  }
+
+  for (i = 0; i < mm_ksm_scan && i < numfp; i++)
+  {
+    nr += ksm_scan_frame(mram, &mram->frmtbl[ksm_cursor]);
+    ksm_cursor = (ksm_cursor + 1) % numfp;
+  }
+
+  ksm_nr_scan += i;
+  ksm_nr_merge += nr;
+  return nr;
+}
+
+/*
+ *  ksm_account_unmerge - count a write copying a page off a merged frame
+ */
+void ksm_account_unmerge(void)
+{
+  __atomic_fetch_add(&ksm_nr_unmerge, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  ksm_report - print pages merged and frames saved
+ */
+int ksm_report(struct memphy_struct *mram)
+{
+  if (mm_ksm_scan <= 0)
+    return 0;
+
+  printf("----------------SAME PAGE MERGING-------------- \n");
+  printf("frames scanned=%ld pages merged=%ld unmerged by writes=%ld skipped busy=%ld stale or colliding hashes=%ld\n",
+         ksm_nr_scan, ksm_nr_merge, ksm_nr_unmerge, ksm_nr_busy, ksm_nr_stale);
+  printf("frames saved now=%d peak=%d (%ld bytes)\n",
+         mram->ksm_saved, mram->ksm_peak, (long)mram->ksm_peak * PAGING_PAGESZ);
+
+  return 0;
+}
+#endif
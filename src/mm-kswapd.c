@@ -0,0 +1,83 @@
+/*
+ * PAGING based Memory Management
+ * Background reclaim mm/mm-kswapd.c
+ *
+ * A reclaim thread runs once per time slot next to the CPUs. When the
+ * free frames of MEMRAM fall below the low watermark it evicts pages
+ * until the high watermark is reached, so a fault usually finds a
+ * free frame ready instead of evicting a victim inline.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef MM_PAGING
+int mm_kswapd_low = 0;  /* 0 keeps background reclaim off */
+int mm_kswapd_high = 0; /* 0 means twice the low watermark */
+
+/* Statistics, the reclaim thread is the only writer but for direct */
+static long kswapd_nr_wakeup, kswapd_nr_reclaim, kswapd_nr_fail;
+static long kswapd_nr_direct;
+
+static int kswapd_high(void)
+{
+  return (mm_kswapd_high > mm_kswapd_low) ? mm_kswapd_high : 2 * mm_kswapd_low;
+}
+
+/*
+ *  kswapd_balance - bring free frames back above the watermarks
+ *  @mram: MEMRAM
+ *  Called by the reclaim thread once per time slot
+ *  Return the number of frames reclaimed
+ */
+int kswapd_balance(struct memphy_struct *mram)
+{
+  int high = kswapd_high();
+  int nr, fpn;
+
+  if (mm_kswapd_low <= 0 || MEMPHY_nr_free(mram) >= mm_kswapd_low)
+    return 0;
+
+  kswapd_nr_wakeup++;
+
+  /* CPUs keep taking frames meanwhile, one batch at most per slot */
+  for (nr = 0; nr < high && MEMPHY_nr_free(mram) < high; nr++)
+  {
+    if (pg_evict_frame(mram, NULL, &fpn) < 0)
+    { /* Every mapper busy or swap full, retry next slot */
+      kswapd_nr_fail++;
+      break;
+    }
+    MEMPHY_put_freefp(mram, fpn);
+  }
+
+  kswapd_nr_reclaim += nr;
+  return nr;
+}
+
+/*
+ *  kswapd_account_direct - count a fault that had to evict by itself
+ */
+void kswapd_account_direct(void)
+{
+  __atomic_fetch_add(&kswapd_nr_direct, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  kswapd_report - print background reclaim activity
+ */
+int kswapd_report(void)
+{
+  if (mm_kswapd_low <= 0)
+    return 0;
+
+  printf("----------------BACKGROUND RECLAIM-------------- \n");
+  printf("watermarks low=%d high=%d wakeups=%ld reclaimed=%ld failed=%ld\n",
+         mm_kswapd_low, kswapd_high(), kswapd_nr_wakeup, kswapd_nr_reclaim,
+         kswapd_nr_fail);
+  printf("faults evicting inline (direct reclaim)=%ld\n", kswapd_nr_direct);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,203 @@
+/*
+ * PAGING based Memory Management
+ * Resident frame limits mm/mm-memcg.c
+ *
+ * A MEMRAM frame is charged to the process owning it in the reverse
+ * map, and to the group of that process, from the moment it is linked
+ * on the used lists until it is unlinked. A process may have a limit
+ * of its own, and its group one for all its members. A process at a
+ * limit pays for a new frame with one of its own pages, in the fault
+ * path as well as for eager allocations, so it cannot push the other
+ * processes into swap.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#ifdef MM_PAGING
+#ifdef MLQ_SCHED
+#define MEMCG_NR_GROUP MAX_PRIO
+#else
+#define MEMCG_NR_GROUP 1
+#endif
+
+int mm_rss_max = 0; /* limit of every process, 0 for none */
+
+static struct mem_cgroup memcg_tbl[MEMCG_NR_GROUP];
+static int memcg_nr_capped; /* processes running under some limit */
+
+/*
+ *  memcg_set_limit - set the limit of a group
+ *  @id: group, the priority of its processes
+ *  @frames: limit, 0 for none
+ *  Return 0 on success, -1 if there is no such group
+ */
+int memcg_set_limit(int id, int frames)
+{
+  if (id < 0 || id >= MEMCG_NR_GROUP || frames < 0)
+    return -1;
+
+  memcg_tbl[id].limit = frames;
+  return 0;
+}
+
+/*
+ *  memcg_attach - put a new process in a group
+ *  @mm: memory of the process, nothing charged yet
+ *  @id: group, out of range ids go to the nearest group
+ *  @rss_max: limit of the process, -1 for the default mm_rss_max
+ */
+void memcg_attach(struct mm_struct *mm, int id, int rss_max)
+{
+  struct mem_cgroup *memcg;
+
+  if (id < 0)
+    id = 0;
+  if (id >= MEMCG_NR_GROUP)
+    id = MEMCG_NR_GROUP - 1;
+
+  /* Concurrent attaches to a group all store the same id */
+  memcg = &memcg_tbl[id];
+  __atomic_store_n(&memcg->id, id, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&memcg->nproc, 1, __ATOMIC_RELAXED);
+
+  mm->memcg = memcg;
+  mm->rss_max = (rss_max >= 0) ? rss_max : mm_rss_max;
+  if (mm->rss_max > 0 || memcg->limit > 0)
+    __atomic_fetch_add(&memcg_nr_capped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  memcg_fork - put a forked child in the group of its parent
+ *  The child inherits the limit of the parent
+ */
+void memcg_fork(struct mm_struct *child, struct mm_struct *parent)
+{
+  child->rss_charged = child->rss_peak = child->rss_evict = 0;
+  child->memcg = NULL;
+  child->rss_max = 0;
+  if (parent->memcg != NULL)
+    memcg_attach(child, __atomic_load_n(&parent->memcg->id, __ATOMIC_RELAXED),
+                 parent->rss_max);
+}
+
+/*
+ *  memcg_charge - account frames the owner of gets or loses
+ *  @mm: owner of the frames
+ *  @nr: frames charged, negative to uncharge
+ *  Caller holds the fp_lock of MEMRAM, the counters are read without it
+ */
+void memcg_charge(struct mm_struct *mm, int nr)
+{
+  struct mem_cgroup *memcg = mm->memcg;
+  int rss, usage;
+
+  rss = __atomic_add_fetch(&mm->rss_charged, nr, __ATOMIC_RELAXED);
+  if (rss > mm->rss_peak)
+    mm->rss_peak = rss;
+
+  if (memcg == NULL)
+    return;
+
+  usage = __atomic_add_fetch(&memcg->usage, nr, __ATOMIC_RELAXED);
+  if (usage > memcg->peak)
+    memcg->peak = usage;
+}
+
+/*
+ *  memcg_limit_room - frames a process may still take before each limit
+ *  @mm: memory of the process
+ *  @own: return the room before the limits of the process itself, the
+ *        frame budget of the fault frequency controller is one too
+ *  @group: return the room before the limit of its group
+ *  Either is INT_MAX where there is no limit
+ */
+void memcg_limit_room(struct mm_struct *mm, int *own, int *group)
+{
+  struct mem_cgroup *memcg = mm->memcg;
+
+  *own = INT_MAX;
+  if (mm->rss_max > 0)
+    *own = mm->rss_max;
+  if (mm->rss_pff > 0 && mm->rss_pff < *own)
+    *own = mm->rss_pff;
+  if (*own < INT_MAX)
+    *own -= __atomic_load_n(&mm->rss_charged, __ATOMIC_RELAXED);
+
+  *group = INT_MAX;
+  if (memcg != NULL && memcg->limit > 0)
+    *group = memcg->limit - __atomic_load_n(&memcg->usage, __ATOMIC_RELAXED);
+}
+
+/*
+ *  memcg_room - frames a process may still take before a limit
+ *  @mm: memory of the process
+ *  Return INT_MAX if neither the process nor its group has a limit
+ */
+int memcg_room(struct mm_struct *mm)
+{
+  int own, group;
+
+  memcg_limit_room(mm, &own, &group);
+  return (own < group) ? own : group;
+}
+
+/*
+ *  memcg_account_evict - count a page a process evicted to stay in its limits
+ *  @mm: memory of the process, locked by the caller
+ */
+void memcg_account_evict(struct mm_struct *mm)
+{
+  mm->rss_evict++;
+  if (mm->memcg != NULL)
+    __atomic_fetch_add(&mm->memcg->evict, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  memcg_report_mm - print the resident frames of a finished process
+ */
+int memcg_report_mm(int pid, struct mm_struct *mm)
+{
+  if (mm->rss_max <= 0 && (mm->memcg == NULL || mm->memcg->limit <= 0))
+    return 0;
+
+  printf("\tPID %2d: resident frames peak=%d limit=%d (group %d limit=%d) evicted over limit=%d\n",
+         pid, mm->rss_peak, mm->rss_max, mm->memcg->id, mm->memcg->limit, mm->rss_evict);
+
+  return 0;
+}
+
+/*
+ *  memcg_report - print the usage of every group against its limit
+ */
+int memcg_report(void)
+{
+  struct mem_cgroup *memcg;
+  int id;
+
+  if (memcg_nr_capped == 0)
+    return 0;
+
+  printf("----------------RESIDENT LIMITS-------------- \n");
+  printf("processes under a limit=%d default process limit=%d frames (0 for none)\n",
+         memcg_nr_capped, mm_rss_max);
+  for (id = 0; id < MEMCG_NR_GROUP; id++)
+  {
+    memcg = &memcg_tbl[id];
+    if (memcg->nproc == 0)
+      continue;
+
+    if (memcg->limit > 0)
+      printf("group %3d: processes=%d limit=%d peak=%d (%.2f%% of limit) now=%d evicted over limit=%ld\n",
+             id, memcg->nproc, memcg->limit, memcg->peak,
+             100.0 * memcg->peak / memcg->limit, memcg->usage, memcg->evict);
+    else
+      printf("group %3d: processes=%d no limit peak=%d now=%d evicted over a process limit=%ld\n",
+             id, memcg->nproc, memcg->peak, memcg->usage, memcg->evict);
+  }
+
+  return 0;
+}
+#endif
@@ -6,8 +6,60 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// #define TEST_MEMPHY
+/* HOW TO TEST
+Uncomment #define TEST_MEMPHY before testing
+cd to your Project
+run gcc -Iinclude -o memphy src/mm-memphy.c -lpthread
+*/
 
 #ifdef MM_PAGING
+/* Magazine slot of the calling thread, -1 for non CPU threads */
+static __thread int memphy_cpu = -1;
+
+/* Frames a used frame stands for on the used lists */
+#define MEMPHY_FP_FRAMES(fp) ((fp)->huge ? (fp)->huge : 1)
+
+#define MEMPHY_MAP_BITS (8 * (int)sizeof(unsigned long))
+
+/*
+ *  MEMPHY_mark_free - flag a frame entering or leaving the free frames
+ *  Caller holds the lock of the pool or magazine the frame moves in or
+ *  out of, neighbours of the word may move under other locks
+ */
+static void MEMPHY_mark_free(struct memphy_struct *mp, int fpn, int isfree)
+{
+   unsigned long bit = 1UL << (fpn % MEMPHY_MAP_BITS);
+
+   if (mp->free_map == NULL)
+      return;
+
+   if (isfree)
+      __atomic_fetch_or(&mp->free_map[fpn / MEMPHY_MAP_BITS], bit, __ATOMIC_RELAXED);
+   else
+      __atomic_fetch_and(&mp->free_map[fpn / MEMPHY_MAP_BITS], ~bit, __ATOMIC_RELAXED);
+}
+
+/*
+ *  MEMPHY_bind_cpu - bind calling thread to a per-CPU frame magazine
+ *  @cpuid: CPU id, the thread uses the shared pool only if out of range
+ */
+void MEMPHY_bind_cpu(int cpuid)
+{
+   memphy_cpu = (cpuid >= 0 && cpuid < MEMPHY_MAX_CPU) ? cpuid : -1;
+}
+
+int MEMPHY_get_cpu(void)
+{
+   return memphy_cpu;
+}
+
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
  *  @mp: memphy struct
@@ -42,8 +94,10 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
    if (!mp->rdmflg)
       return -1; /* Not compatible mode for sequential read */
 
+   pthread_mutex_lock(&mp->csr_lock);
    MEMPHY_mv_csr(mp, addr);
    *value = (BYTE)mp->storage[addr];
+   pthread_mutex_unlock(&mp->csr_lock);
 
    return 0;
 }
@@ -82,8 +136,10 @@ int MEMPHY_seq_write(struct memphy_struct *mp, int addr, BYTE value)
    if (!mp->rdmflg)
       return -1; /* Not compatible mode for sequential read */
 
+   pthread_mutex_lock(&mp->csr_lock);
    MEMPHY_mv_csr(mp, addr);
    mp->storage[addr] = value;
+   pthread_mutex_unlock(&mp->csr_lock);
 
    return 0;
 }
@@ -107,6 +163,27 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data)
    return 0;
 }
 
+/*
+ *  MEMPHY_zero_frame - fill a frame with zeroes
+ *  @mp: memphy struct
+ *  @fpn: frame to clear
+ */
+int MEMPHY_zero_frame(struct memphy_struct *mp, int fpn)
+{
+   int i;
+
+   if (mp == NULL)
+      return -1;
+
+   if (mp->rdmflg)
+      memset(mp->storage + fpn * PAGING_PAGESZ, 0, PAGING_PAGESZ);
+   else
+      for (i = 0; i < PAGING_PAGESZ; i++)
+         MEMPHY_seq_write(mp, fpn * PAGING_PAGESZ + i, 0);
+
+   return 0;
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
@@ -118,12 +195,14 @@ int MEMPHY_format(struct memphy_struct *mp, int pagesz)
    struct framephy_struct *newfst, *fst;
    int iter = 0;
 
+   mp->nr_free = (numfp > 0) ? numfp : 0;
    if (numfp <= 0)
       return -1;
 
    /* Init head of free framephy list */
    fst = malloc(sizeof(struct framephy_struct));
    fst->fpn = iter;
+   fst->fp_next = NULL;
    mp->free_fp_list = fst;
 
    /* We have list with first element, fill in the rest num-1 element member*/
@@ -139,7 +218,13 @@ int MEMPHY_format(struct memphy_struct *mp, int pagesz)
    return 0;
 }
 
-int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+/*
+ *  MEMPHY_pop_freefp - take a frame from the shared pool
+ *  @mp: memphy struct
+ *  @retfpn: obtained frame
+ *  Caller must hold mp->fp_lock
+ */
+static int MEMPHY_pop_freefp(struct memphy_struct *mp, int *retfpn)
 {
    struct framephy_struct *fp = mp->free_fp_list;
 
@@ -157,38 +242,787 @@ int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
    return 0;
 }
 
+/*
+ *  MEMPHY_push_freefp - return a frame to the shared pool
+ *  Caller must hold mp->fp_lock
+ */
+static void MEMPHY_push_freefp(struct memphy_struct *mp, struct framephy_struct *newnode, int fpn)
+{
+   newnode->fpn = fpn;
+   newnode->fp_next = mp->free_fp_list;
+   mp->free_fp_list = newnode;
+}
+
+/*
+ *  MEMPHY_steal_freefp - take a frame cached in any magazine
+ *  Only used when the shared pool ran dry, so frames parked
+ *  in idle CPUs magazines are never lost to the others
+ */
+static int MEMPHY_steal_freefp(struct memphy_struct *mp, int *retfpn)
+{
+   int cpu;
+
+   for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+   {
+      struct memphy_mag *mag = &mp->mag[cpu];
+
+      pthread_mutex_lock(&mag->lock);
+      if (mag->cnt > 0)
+      {
+         *retfpn = mag->fpn[--mag->cnt];
+         MEMPHY_mark_free(mp, *retfpn, 0);
+         pthread_mutex_unlock(&mag->lock);
+         return 0;
+      }
+      pthread_mutex_unlock(&mag->lock);
+   }
+
+   return -1;
+}
+
+static int MEMPHY_take_freefp(struct memphy_struct *mp, int *retfpn)
+{
+   struct memphy_mag *mag;
+   int ret;
+
+   if (memphy_cpu >= 0)
+   {
+      mag = &mp->mag[memphy_cpu];
+      pthread_mutex_lock(&mag->lock);
+
+      /* Refill the magazine in one batch from the shared pool */
+      if (mag->cnt == 0)
+      {
+         pthread_mutex_lock(&mp->fp_lock);
+         while (mag->cnt < MEMPHY_MAG_BATCH &&
+                MEMPHY_pop_freefp(mp, &mag->fpn[mag->cnt]) == 0)
+            mag->cnt++;
+         pthread_mutex_unlock(&mp->fp_lock);
+      }
+
+      if (mag->cnt > 0)
+      {
+         *retfpn = mag->fpn[--mag->cnt];
+         MEMPHY_mark_free(mp, *retfpn, 0);
+         pthread_mutex_unlock(&mag->lock);
+         return 0;
+      }
+      pthread_mutex_unlock(&mag->lock);
+   }
+   else
+   {
+      pthread_mutex_lock(&mp->fp_lock);
+      ret = MEMPHY_pop_freefp(mp, retfpn);
+      if (ret == 0)
+         MEMPHY_mark_free(mp, *retfpn, 0);
+      pthread_mutex_unlock(&mp->fp_lock);
+      if (ret == 0)
+         return 0;
+   }
+
+   return MEMPHY_steal_freefp(mp, retfpn);
+}
+
+/*
+ *  MEMPHY_pop_zerofp - take a frame from the pool of cleared frames
+ */
+static int MEMPHY_pop_zerofp(struct memphy_struct *mp, int *retfpn)
+{
+   int ret = -1;
+
+   if (mp->zero_sz == 0)
+      return -1;
+
+   pthread_mutex_lock(&mp->zero_lock);
+   if (mp->zero_cnt > 0)
+   {
+      *retfpn = mp->zero_fpn[--mp->zero_cnt];
+      ret = 0;
+   }
+   pthread_mutex_unlock(&mp->zero_lock);
+
+   return ret;
+}
+
+/*
+ *  MEMPHY_get_freefp - take a free frame, its content is undefined
+ *  Cleared frames are only used up once every other free frame is gone
+ */
+int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+{
+   if (mp == NULL)
+      return -1;
+
+   if (MEMPHY_take_freefp(mp, retfpn) < 0 && MEMPHY_pop_zerofp(mp, retfpn) < 0)
+      return -1;
+
+   __atomic_fetch_sub(&mp->nr_free, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/*
+ *  MEMPHY_get_zerofp - take a free frame from the pool of cleared frames
+ *  Return 0 on success, -1 if the pool is empty
+ */
+int MEMPHY_get_zerofp(struct memphy_struct *mp, int *retfpn)
+{
+   if (mp == NULL || MEMPHY_pop_zerofp(mp, retfpn) < 0)
+      return -1;
+
+   __atomic_fetch_sub(&mp->nr_free, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/*
+ *  MEMPHY_init_zero - set up the pool of cleared frames
+ *  @mp: memphy struct
+ *  @nr: pool capacity in frames, 0 keeps the pool off
+ */
+int MEMPHY_init_zero(struct memphy_struct *mp, int nr)
+{
+   if (nr <= 0)
+      return 0;
+
+   mp->zero_fpn = malloc(nr * sizeof(int));
+   if (mp->zero_fpn == NULL)
+      return -1;
+   mp->zero_sz = nr;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_fill_zerofp - clear free frames into the pool until it is full
+ *  @mp: memphy struct
+ *  Return the number of frames cleared. The frames stay counted free
+ *  while they move from the free pool to the cleared one. Caller must
+ *  be the only thread filling the pool
+ */
+int MEMPHY_fill_zerofp(struct memphy_struct *mp)
+{
+   int nr = 0, fpn, room;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&mp->zero_lock);
+      room = mp->zero_sz - mp->zero_cnt;
+      pthread_mutex_unlock(&mp->zero_lock);
+
+      if (room == 0 || MEMPHY_take_freefp(mp, &fpn) < 0)
+         break;
+      MEMPHY_zero_frame(mp, fpn);
+
+      /* Takers only shrink the pool meanwhile, the frame fits */
+      pthread_mutex_lock(&mp->zero_lock);
+      mp->zero_fpn[mp->zero_cnt++] = fpn;
+      pthread_mutex_unlock(&mp->zero_lock);
+      nr++;
+   }
+
+   return nr;
+}
+
+/*
+ *  MEMPHY_nr_free - number of free frames, pooled or cached by a CPU
+ */
+int MEMPHY_nr_free(struct memphy_struct *mp)
+{
+   return __atomic_load_n(&mp->nr_free, __ATOMIC_RELAXED);
+}
+
 int MEMPHY_dump(struct memphy_struct *mp)
 {
     /*TODO dump memphy contnt mp->storage 
      *     for tracing the memory content
      */
+    int fpn, i, end;
+
     printf("----------------MEMORY CONTENT-------------- \n");
     printf("Address: Content \n");
-    for (int i = 0; i < mp->maxsz; i++)
-      if (mp->storage[i]) printf("0x%08x: %08x \n", i, mp->storage[i]);
+    if (mp->frmtbl == NULL)
+    {
+      for (i = 0; i < mp->maxsz; i++)
+        if (mp->storage[i]) printf("0x%08x: %08x \n", i, mp->storage[i]);
+      return 0;
+    }
+
+    /* Only mapped frames, a GB sized MEMRAM is mostly free */
+    for (fpn = 0; fpn < mp->maxsz / PAGING_PAGESZ; fpn++)
+    {
+      if (__atomic_load_n(&mp->frmtbl[fpn].owner, __ATOMIC_RELAXED) == NULL)
+        continue;
+      end = (fpn + 1) * PAGING_PAGESZ;
+      for (i = fpn * PAGING_PAGESZ; i < end; i++)
+        if (mp->storage[i]) printf("0x%08x: %08x \n", i, mp->storage[i]);
+    }
     return 0;
 }
 
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 {
-   struct framephy_struct *fp = mp->free_fp_list;
-   struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+   struct framephy_struct *batch[MEMPHY_MAG_BATCH];
+   struct memphy_mag *mag;
+   int i;
 
-   /* Create new node with value fpn */
-   newnode->fpn = fpn;
-   newnode->fp_next = fp;
-   mp->free_fp_list = newnode;
+   if (mp == NULL)
+      return -1;
+
+   __atomic_fetch_add(&mp->nr_free, 1, __ATOMIC_RELAXED);
+
+   if (memphy_cpu < 0)
+   {
+      struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+
+      pthread_mutex_lock(&mp->fp_lock);
+      MEMPHY_push_freefp(mp, newnode, fpn);
+      MEMPHY_mark_free(mp, fpn, 1);
+      pthread_mutex_unlock(&mp->fp_lock);
+      return 0;
+   }
+
+   mag = &mp->mag[memphy_cpu];
+   pthread_mutex_lock(&mag->lock);
+
+   /* Magazine full, drain one batch back to the shared pool */
+   if (mag->cnt == MEMPHY_MAG_SZ)
+   {
+      for (i = 0; i < MEMPHY_MAG_BATCH; i++)
+         batch[i] = malloc(sizeof(struct framephy_struct));
+
+      pthread_mutex_lock(&mp->fp_lock);
+      for (i = 0; i < MEMPHY_MAG_BATCH; i++)
+         MEMPHY_push_freefp(mp, batch[i], mag->fpn[--mag->cnt]);
+      pthread_mutex_unlock(&mp->fp_lock);
+   }
+
+   mag->fpn[mag->cnt++] = fpn;
+   MEMPHY_mark_free(mp, fpn, 1);
+   pthread_mutex_unlock(&mag->lock);
 
    return 0;
 }
 
 /*
- *  Init MEMPHY struct
+ *  MEMPHY_init_rmap - allocate the reverse map of a MEMPHY
+ *  Only MEMRAM needs it, frames of swap devices are not mapped
  */
-int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+int MEMPHY_init_rmap(struct memphy_struct *mp)
 {
-   mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
-   mp->maxsz = max_size;
+   int numfp = mp->maxsz / PAGING_PAGESZ;
+   struct framephy_struct *fp;
+   int fpn;
+
+   mp->frmtbl = calloc(numfp > 0 ? numfp : 1, sizeof(struct framephy_struct));
+   mp->free_map = calloc(DIV_ROUND_UP(numfp > 0 ? numfp : 1, MEMPHY_MAP_BITS), sizeof(unsigned long));
+   if (mp->frmtbl == NULL || mp->free_map == NULL)
+      return -1;
+
+   /* Free frames runs are searched for huge pages */
+   for (fp = mp->free_fp_list; fp != NULL; fp = fp->fp_next)
+      MEMPHY_mark_free(mp, fp->fpn, 1);
+
+   for (fpn = 0; fpn < numfp; fpn++)
+   {
+      mp->frmtbl[fpn].fpn = fpn;
+      mp->frmtbl[fpn].in_RAM = 1;
+      mp->frmtbl[fpn].swpoff = -1;
+   }
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_link_usedfp - link a frame as the newest of the used lists
+ *  Caller must hold mp->fp_lock
+ */
+static void MEMPHY_link_usedfp(struct memphy_struct *mp, struct framephy_struct *fp,
+                               struct mm_struct *owner, int pgn)
+{
+   struct framephy_struct *head;
+
+   fp->owner = owner;
+   fp->pgn = pgn;
+   fp->age = 0;
+   fp->ra = 0;
+   memcg_charge(owner, MEMPHY_FP_FRAMES(fp));
+
+   head = mp->used_fp_list;
+   if (head == NULL)
+   {
+      fp->fp_next = fp->fp_prev = fp;
+   }
+   else
+   {
+      fp->fp_next = head;
+      fp->fp_prev = head->fp_prev;
+      head->fp_prev->fp_next = fp;
+      head->fp_prev = fp;
+   }
+   mp->used_fp_list = fp;
+
+   /* Same order on the ring of the owner, used by local replacement */
+   head = owner->resident;
+   if (head == NULL)
+   {
+      fp->mm_next = fp->mm_prev = fp;
+   }
+   else
+   {
+      fp->mm_next = head;
+      fp->mm_prev = head->mm_prev;
+      head->mm_prev->mm_next = fp;
+      head->mm_prev = fp;
+   }
+   owner->resident = fp;
+}
+
+/*
+ *  MEMPHY_put_usedfp - record a frame mapped by a page of owner
+ *  @mp: memphy struct
+ *  @fpn: mapped frame
+ *  @owner: mm mapping the frame
+ *  @pgn: page of owner
+ *  The frame becomes the newest one of the used list
+ */
+int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn)
+{
+   struct framephy_struct *fp;
+   struct frame_map *map;
+
+   if (mp == NULL || mp->frmtbl == NULL)
+      return -1;
+
+   fp = &mp->frmtbl[fpn];
+
+   pthread_mutex_lock(&mp->fp_lock);
+   MEMPHY_link_usedfp(mp, fp, owner, pgn);
+   /* A victim relinked after a failed eviction keeps its other mappers */
+   fp->mapcount = 1;
+   for (map = fp->maps; map != NULL; map = map->next)
+      fp->mapcount++;
+   pthread_mutex_unlock(&mp->fp_lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_ksm_account - count a mapper joining or leaving a merged frame
+ *  Caller must hold mp->fp_lock
+ */
+static void MEMPHY_ksm_account(struct memphy_struct *mp, int delta)
+{
+   mp->ksm_saved += delta;
+   if (mp->ksm_saved > mp->ksm_peak)
+      mp->ksm_peak = mp->ksm_saved;
+}
+
+/*
+ *  MEMPHY_ksm_drop - a merged frame leaves MEMRAM with all its mappers
+ *  @mp: memphy struct
+ *  @fp: frame, its extra mappers are not dropped yet
+ */
+void MEMPHY_ksm_drop(struct memphy_struct *mp, struct framephy_struct *fp)
+{
+   pthread_mutex_lock(&mp->fp_lock);
+   if (fp->ksm)
+   {
+      MEMPHY_ksm_account(mp, 1 - fp->mapcount);
+      fp->ksm = 0;
+   }
+   pthread_mutex_unlock(&mp->fp_lock);
+}
+
+/*
+ *  MEMPHY_share_usedfp - record one more page mapping a used frame
+ *  @mp: memphy struct
+ *  @fpn: frame already mapped by its owner
+ *  @mm: new mapper, must not map the frame yet
+ *  @pgn: page of mm
+ */
+int MEMPHY_share_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *mm, int pgn)
+{
+   struct framephy_struct *fp;
+   struct frame_map *map;
+
+   if (mp == NULL || mp->frmtbl == NULL)
+      return -1;
+
+   fp = &mp->frmtbl[fpn];
+   map = malloc(sizeof(struct frame_map));
+   map->mm = mm;
+   map->pgn = pgn;
+
+   pthread_mutex_lock(&mp->fp_lock);
+   map->next = fp->maps;
+   fp->maps = map;
+   fp->mapcount++;
+   if (fp->ksm)
+      MEMPHY_ksm_account(mp, 1);
+   pthread_mutex_unlock(&mp->fp_lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_unshare_usedfp - drop the mapping of a used frame by a page
+ *  @mp: memphy struct
+ *  @fpn: mapped frame
+ *  @mm, @pgn: mapping going away
+ *  Return the number of mappings left, the frame is unlinked at 0.
+ *  When the owner goes, the next mapper takes the frame over
+ */
+int MEMPHY_unshare_usedfp(struct memphy_struct *mp, int fpn, struct mm_struct *mm, int pgn)
+{
+   struct framephy_struct *fp;
+   struct frame_map *map, **pmap;
+   int left;
+
+   if (mp == NULL || mp->frmtbl == NULL)
+      return -1;
+
+   fp = &mp->frmtbl[fpn];
+   map = NULL;
+
+   pthread_mutex_lock(&mp->fp_lock);
+   if (fp->owner == mm && fp->pgn == pgn)
+   {
+      map = fp->maps;
+      MEMPHY_unlink_usedfp(mp, fp);
+      if (map != NULL)
+      {
+         fp->maps = map->next;
+         MEMPHY_link_usedfp(mp, fp, map->mm, map->pgn);
+      }
+   }
+   else
+   {
+      for (pmap = &fp->maps; *pmap != NULL; pmap = &(*pmap)->next)
+         if ((*pmap)->mm == mm && (*pmap)->pgn == pgn)
+         {
+            map = *pmap;
+            *pmap = map->next;
+            break;
+         }
+   }
+   left = --fp->mapcount;
+   if (fp->ksm)
+   { /* A merged frame left with one mapper is private again */
+      if (left > 0)
+         MEMPHY_ksm_account(mp, -1);
+      if (left <= 1)
+         fp->ksm = 0;
+   }
+   pthread_mutex_unlock(&mp->fp_lock);
+
+   free(map);
+   return left;
+}
+
+/*
+ *  MEMPHY_unlink_usedfp - take a frame out of the used list
+ *  Caller must hold mp->fp_lock
+ */
+void MEMPHY_unlink_usedfp(struct memphy_struct *mp, struct framephy_struct *fp)
+{
+   struct mm_struct *owner = fp->owner;
+
+   if (fp->fp_next == NULL)
+      return; /* Not linked */
+
+   /* A clock hand on the frame moves on to the next newer one */
+   if (mp->clock_hand == fp)
+      mp->clock_hand = (fp->fp_prev != fp) ? fp->fp_prev : NULL;
+   if (owner->clock_hand == fp)
+      owner->clock_hand = (fp->mm_prev != fp) ? fp->mm_prev : NULL;
+
+   if (fp->fp_next == fp)
+   {
+      mp->used_fp_list = NULL;
+   }
+   else
+   {
+      fp->fp_prev->fp_next = fp->fp_next;
+      fp->fp_next->fp_prev = fp->fp_prev;
+      if (mp->used_fp_list == fp)
+         mp->used_fp_list = fp->fp_next;
+   }
+
+   if (fp->mm_next == fp)
+   {
+      owner->resident = NULL;
+   }
+   else
+   {
+      fp->mm_prev->mm_next = fp->mm_next;
+      fp->mm_next->mm_prev = fp->mm_prev;
+      if (owner->resident == fp)
+         owner->resident = fp->mm_next;
+   }
+
+   fp->fp_next = fp->fp_prev = NULL;
+   fp->mm_next = fp->mm_prev = NULL;
+   fp->owner = NULL;
+   memcg_charge(owner, -MEMPHY_FP_FRAMES(fp));
+}
+
+/*
+ *  MEMPHY_remove_usedfp - forget the mapping of a frame
+ *  @mp: memphy struct
+ *  @fpn: frame being unmapped
+ */
+int MEMPHY_remove_usedfp(struct memphy_struct *mp, int fpn)
+{
+   if (mp == NULL || mp->frmtbl == NULL)
+      return -1;
+
+   pthread_mutex_lock(&mp->fp_lock);
+   MEMPHY_unlink_usedfp(mp, &mp->frmtbl[fpn]);
+   pthread_mutex_unlock(&mp->fp_lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_run_free - find whether a run of frames is all free
+ *  @mp: memphy struct
+ *  @base: first frame, aligned on nr
+ *  @nr: number of frames, a power of two
+ *  Return -1 if it is, else the first busy frame
+ */
+static int MEMPHY_run_free(struct memphy_struct *mp, int base, int nr)
+{
+   unsigned long mask, word;
+   int fpn, bits;
+
+   for (fpn = base; fpn < base + nr; fpn += bits)
+   {
+      /* A run either fills whole words or lies within one */
+      bits = (nr < MEMPHY_MAP_BITS) ? nr : MEMPHY_MAP_BITS;
+      mask = (bits < MEMPHY_MAP_BITS) ? ((1UL << bits) - 1) << (fpn % MEMPHY_MAP_BITS) : ~0UL;
+      word = __atomic_load_n(&mp->free_map[fpn / MEMPHY_MAP_BITS], __ATOMIC_RELAXED);
+      if ((word & mask) != mask)
+         return fpn + __builtin_ctzl(~word & mask) - (fpn % MEMPHY_MAP_BITS);
+   }
+
+   return -1;
+}
+
+/*
+ *  MEMPHY_get_freefp_range - take a run of free frames aligned on its size
+ *  @mp: memphy struct
+ *  @nr: number of frames, a power of two
+ *  @retfpn: first frame of the run
+ *  The frames cached by the magazines count as free too, every magazine
+ *  is locked while the run is searched
+ */
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int nr, int *retfpn)
+{
+   int numfp = mp->maxsz / PAGING_PAGESZ;
+   struct framephy_struct *fp, **pfp;
+   struct memphy_mag *mag;
+   int cpu, i, j, busy, base = -1;
+
+   if (nr <= 0 || mp->free_map == NULL || MEMPHY_nr_free(mp) < nr)
+      return -1;
+
+   for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+      pthread_mutex_lock(&mp->mag[cpu].lock);
+   pthread_mutex_lock(&mp->fp_lock);
+
+   /* A busy frame rules out every run up to its own */
+   for (i = 0; i + nr <= numfp && base < 0; )
+   {
+      if (mp->free_map[i / MEMPHY_MAP_BITS] == 0 && nr <= MEMPHY_MAP_BITS)
+         i = (i / MEMPHY_MAP_BITS + 1) * MEMPHY_MAP_BITS;
+      else if ((busy = MEMPHY_run_free(mp, i, nr)) >= 0)
+         i = (busy / nr + 1) * nr;
+      else
+         base = i;
+   }
+
+   if (base >= 0)
+   {
+      pfp = &mp->free_fp_list;
+      while (*pfp != NULL)
+      {
+         fp = *pfp;
+         if (fp->fpn >= base && fp->fpn < base + nr)
+         {
+            *pfp = fp->fp_next;
+            free(fp);
+         }
+         else
+            pfp = &fp->fp_next;
+      }
+
+      for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+      {
+         mag = &mp->mag[cpu];
+         for (i = j = 0; i < mag->cnt; i++)
+            if (mag->fpn[i] < base || mag->fpn[i] >= base + nr)
+               mag->fpn[j++] = mag->fpn[i];
+         mag->cnt = j;
+      }
+
+      for (i = base; i < base + nr; i++)
+         MEMPHY_mark_free(mp, i, 0);
+      __atomic_fetch_sub(&mp->nr_free, nr, __ATOMIC_RELAXED);
+      *retfpn = base;
+   }
+
+   pthread_mutex_unlock(&mp->fp_lock);
+   for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+      pthread_mutex_unlock(&mp->mag[cpu].lock);
+
+   return (base >= 0) ? 0 : -1;
+}
+
+/*
+ *  MEMPHY_put_hugefp - record a run of frames mapped as one huge page
+ *  @mp: memphy struct
+ *  @fpn: first frame, heading the huge page
+ *  @owner: mm mapping the run
+ *  @pgn: first page of owner
+ *  @nr: number of frames
+ *  Only the head frame is linked on the used lists, the huge page is
+ *  replaced as a whole until MEMPHY_split_usedfp breaks it up
+ */
+int MEMPHY_put_hugefp(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn, int nr)
+{
+   struct framephy_struct *fp;
+   int i;
+
+   if (mp == NULL || mp->frmtbl == NULL)
+      return -1;
+
+   pthread_mutex_lock(&mp->fp_lock);
+   for (i = 1; i < nr; i++)
+   {
+      fp = &mp->frmtbl[fpn + i];
+      fp->owner = owner;
+      fp->pgn = pgn + i;
+      fp->mapcount = 1;
+      fp->huge = 0;
+   }
+
+   fp = &mp->frmtbl[fpn];
+   fp->huge = nr;
+   MEMPHY_link_usedfp(mp, fp, owner, pgn);
+   fp->mapcount = 1;
+   pthread_mutex_unlock(&mp->fp_lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_split_usedfp - turn a huge page back into base frames
+ *  @mp: memphy struct
+ *  @fp: head frame of the huge page
+ *  Caller must hold mp->fp_lock. The tail frames are linked after the
+ *  head as the newest frames. Return the number of frames of the page
+ */
+int MEMPHY_split_usedfp(struct memphy_struct *mp, struct framephy_struct *fp)
+{
+   struct framephy_struct *tail;
+   int nr = fp->huge, i;
+
+   /* Every tail is charged again as it gets linked */
+   memcg_charge(fp->owner, 1 - nr);
+   fp->huge = 0;
+   for (i = 1; i < nr; i++)
+   {
+      tail = &mp->frmtbl[fp->fpn + i];
+      MEMPHY_link_usedfp(mp, tail, fp->owner, fp->pgn + i);
+      tail->mapcount = 1;
+   }
+
+   return nr;
+}
+
+/*
+ *  MEMPHY_host_range - host pages range covering a run of frames
+ *  @mp: memphy struct
+ *  @fpn: first frame
+ *  @nframes: number of frames
+ *  @len: returned length of the range
+ */
+static BYTE *MEMPHY_host_range(struct memphy_struct *mp, int fpn, int nframes, size_t *len)
+{
+   long hostpgsz = sysconf(_SC_PAGESIZE);
+   long start = (long)fpn * PAGING_PAGESZ;
+   long end = start + (long)nframes * PAGING_PAGESZ;
+
+   if (end > mp->maxsz)
+      end = mp->maxsz;
+
+   start -= start % hostpgsz;
+   *len = end - start;
+
+   return mp->storage + start;
+}
+
+/*
+ *  MEMPHY_sync_frame - write back a frame of a file backed device
+ *  @mp: memphy struct
+ *  @fpn: frame to write back
+ *  The write back is scheduled (MS_ASYNC), no-op on RAM backed device
+ */
+int MEMPHY_sync_frame(struct memphy_struct *mp, int fpn)
+{
+   size_t len;
+   BYTE *addr;
+
+   if (mp == NULL || mp->fd < 0)
+      return 0;
+
+   addr = MEMPHY_host_range(mp, fpn, 1, &len);
+
+   return msync(addr, len, MS_ASYNC);
+}
+
+/*
+ *  MEMPHY_advise_frames - readahead hint for frames of a file backed device
+ *  @mp: memphy struct
+ *  @fpn: first frame going to be read
+ *  @nframes: number of frames
+ */
+int MEMPHY_advise_frames(struct memphy_struct *mp, int fpn, int nframes)
+{
+   size_t len;
+   BYTE *addr;
+
+   if (mp == NULL || mp->fd < 0)
+      return 0;
+
+   addr = MEMPHY_host_range(mp, fpn, nframes, &len);
+
+   return madvise(addr, len, MADV_WILLNEED);
+}
+
+/*
+ *  MEMPHY_init_mgmt - init frame management of a MEMPHY with storage
+ */
+static int MEMPHY_init_mgmt(struct memphy_struct *mp, int randomflg)
+{
+   int cpu;
+
+   mp->free_fp_list = NULL;
+   mp->used_fp_list = NULL;
+   mp->clock_hand = NULL;
+   mp->frmtbl = NULL;
+   mp->free_map = NULL;
+
+   pthread_mutex_init(&mp->fp_lock, NULL);
+   pthread_mutex_init(&mp->csr_lock, NULL);
+   for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+   {
+      pthread_mutex_init(&mp->mag[cpu].lock, NULL);
+      mp->mag[cpu].cnt = 0;
+   }
+   pthread_mutex_init(&mp->zero_lock, NULL);
+   mp->zero_fpn = NULL;
+   mp->zero_cnt = mp->zero_sz = 0;
+   mp->ksm_saved = mp->ksm_peak = 0;
 
    MEMPHY_format(mp, PAGING_PAGESZ);
 
@@ -200,4 +1034,144 @@ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
    return 0;
 }
 
-#endif
\ No newline at end of file
+/*
+ *  Init MEMPHY struct
+ */
+int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+{
+   mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
+   mp->maxsz = max_size;
+   mp->fd = -1;
+
+   return MEMPHY_init_mgmt(mp, randomflg);
+}
+
+/*
+ *  init_memphy_file - init MEMPHY struct backed by a file
+ *  @mp: memphy struct
+ *  @max_size: device size
+ *  @randomflg: random access device
+ *  @path: backing file, created sparse if it does not exist
+ *
+ *  Storage is a shared mapping of the file so the host only spends
+ *  memory on frames actually touched by the simulation
+ */
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg, const char *path)
+{
+   int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+   if (fd < 0)
+      return -1;
+
+   /* Extending with ftruncate leaves a hole, no block is written */
+   if (ftruncate(fd, max_size) < 0)
+   {
+      close(fd);
+      return -1;
+   }
+
+   mp->storage = (BYTE *)mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (mp->storage == MAP_FAILED)
+   {
+      close(fd);
+      return -1;
+   }
+
+   mp->maxsz = max_size;
+   mp->fd = fd;
+
+   return MEMPHY_init_mgmt(mp, randomflg);
+}
+
+#endif
+
+#ifdef TEST_MEMPHY
+
+#define TEST_NTHREADS 12 /* last threads stay unbound and use the shared pool */
+#define TEST_NBOUND 10
+#define TEST_NFRAMES 64
+#define TEST_ITER 20000
+#define TEST_HOLD 8
+
+/* Built without mm.c, the geometry is the default one */
+int mm_pagesz = PAGING_DEF_PAGESZ;
+int mm_page_shift = 8;
+int mm_bus_width = PAGING_DEF_BUS_WIDTH;
+
+/* Frames are not charged to any group without mm-memcg.c */
+void memcg_charge(struct mm_struct *mm, int nr)
+{
+   (void)mm;
+   (void)nr;
+}
+
+static struct memphy_struct test_mp;
+static int test_holder[TEST_NFRAMES];
+static int test_errors;
+
+static void *test_hammer(void *arg)
+{
+   int tid = (int)(long)arg;
+   unsigned int seed = tid;
+   int held[TEST_HOLD];
+   int it, i, n, fpn;
+
+   if (tid < TEST_NBOUND)
+      MEMPHY_bind_cpu(tid);
+
+   for (it = 0; it < TEST_ITER; it++)
+   {
+      n = 0;
+      while (n < (int)(rand_r(&seed) % TEST_HOLD) + 1 &&
+             MEMPHY_get_freefp(&test_mp, &fpn) == 0)
+      {
+         /* No other thread may hold the frame we were just given */
+         if (__atomic_exchange_n(&test_holder[fpn], tid + 1, __ATOMIC_SEQ_CST) != 0)
+            __atomic_add_fetch(&test_errors, 1, __ATOMIC_SEQ_CST);
+         memset(&test_mp.storage[fpn * PAGING_PAGESZ], tid + 1, PAGING_PAGESZ);
+         held[n++] = fpn;
+      }
+
+      for (i = 0; i < n; i++)
+      {
+         fpn = held[i];
+         if (test_mp.storage[fpn * PAGING_PAGESZ + PAGING_PAGESZ - 1] != (BYTE)(tid + 1))
+            __atomic_add_fetch(&test_errors, 1, __ATOMIC_SEQ_CST);
+         __atomic_store_n(&test_holder[fpn], 0, __ATOMIC_SEQ_CST);
+         MEMPHY_put_freefp(&test_mp, fpn);
+      }
+   }
+
+   return NULL;
+}
+
+int main()
+{
+   pthread_t th[TEST_NTHREADS];
+   int seen[TEST_NFRAMES];
+   int i, fpn, nfree = 0;
+
+   printf("--------------------------- BEGIN MEMPHY ALLOCATION STRESS -----------------------------\n");
+   init_memphy(&test_mp, TEST_NFRAMES * PAGING_PAGESZ, 1);
+   memset(seen, 0, sizeof(seen));
+
+   for (i = 0; i < TEST_NTHREADS; i++)
+      pthread_create(&th[i], NULL, test_hammer, (void *)(long)i);
+   for (i = 0; i < TEST_NTHREADS; i++)
+      pthread_join(th[i], NULL);
+
+   /* Every frame must be back exactly once, cached or pooled */
+   while (MEMPHY_get_freefp(&test_mp, &fpn) == 0)
+   {
+      if (fpn < 0 || fpn >= TEST_NFRAMES || seen[fpn]++)
+         test_errors++;
+      nfree++;
+   }
+
+   printf("Threads: %d Iterations: %d Frames: %d Recovered: %d Errors: %d\n",
+          TEST_NTHREADS, TEST_ITER, TEST_NFRAMES, nfree, test_errors);
+   printf("%s\n", (nfree == TEST_NFRAMES && test_errors == 0) ? "PASS" : "FAIL");
+
+   return (nfree == TEST_NFRAMES && test_errors == 0) ? 0 : 1;
+}
+#endif
@@ -0,0 +1,187 @@
+/*
+ * PAGING based Memory Management
+ * Out of memory killer mm/mm-oom.c
+ *
+ * An eager allocation that finds neither a free MEMRAM frame nor a
+ * swap slot picks a process to kill instead of failing. A process
+ * scores its pages in MEMRAM and in swap, weighted up to twice as much
+ * the lower its priority. The victim is the highest score among the
+ * allocating process and the ready ones. A ready victim is taken out
+ * of scheduling and torn down on the spot, so its frames and slots are
+ * free when the allocation is retried. When the allocating process
+ * scores highest itself, its allocation fails and the process ends
+ * after the instruction.
+ *
+ * A group at its limit with swap full is out of memory on its own,
+ * the victim is picked among its processes only. A process at a limit
+ * of its own kills nobody, its allocation fails.
+ */
+
+#include "mm.h"
+#include "sched.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+int mm_oom_kill = 1; /* 0 lets allocations fail instead */
+
+/* Group the killer of the calling thread picks in, NULL for any process */
+static __thread struct mem_cgroup *oom_memcg;
+
+/* Statistics */
+static long oom_nr_event, oom_nr_kill, oom_nr_self, oom_nr_group;
+
+/*
+ *  oom_swapped - count the pages of a process in swap
+ *  Shared memory segments are left out, they belong to no process
+ */
+static int oom_swapped(struct mm_struct *mm)
+{
+  struct vm_area_struct *vma;
+  unsigned long lo, hi;
+  int pgn, nr = 0;
+  pte_t pte;
+
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+  {
+    if (vma->vm_shm != NULL)
+      continue;
+
+    lo = (vma->vm_start < vma->vm_end) ? vma->vm_start : vma->vm_end;
+    hi = (vma->vm_start < vma->vm_end) ? vma->vm_end : vma->vm_start;
+    for (pgn = PAGING_PGN(lo); pgn < (int)DIV_ROUND_UP(hi, PAGING_PAGESZ); pgn++)
+    {
+      pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+      if (PAGING_PTE_PAGE_PRESENT(pte) && (pte & PAGING_PTE_SWAPPED_MASK) &&
+          !(pte & PAGING_PTE_SHM_MASK))
+        nr++;
+    }
+  }
+
+  return nr;
+}
+
+/*
+ *  oom_score - badness of a process, the highest is killed first
+ *  @rss, @swp: return its pages in MEMRAM and in swap
+ */
+static int oom_score(struct pcb_t *proc, int *rss, int *swp)
+{
+  *rss = __atomic_load_n(&proc->mm->rss_charged, __ATOMIC_RELAXED);
+  *swp = oom_swapped(proc->mm);
+
+#ifdef MLQ_SCHED
+  return (*rss + *swp) * (MAX_PRIO + (int)proc->prio) / MAX_PRIO;
+#else
+  return *rss + *swp;
+#endif
+}
+
+/*
+ *  oom_better - compare victims for the killer
+ *  Outside the group being picked in, a process is never the better one
+ */
+static int oom_better(struct pcb_t *p1, struct pcb_t *p2)
+{
+  int rss, swp;
+
+  if (oom_memcg != NULL && (p1->mm->memcg == oom_memcg) != (p2->mm->memcg == oom_memcg))
+    return p1->mm->memcg == oom_memcg;
+
+  return oom_score(p1, &rss, &swp) > oom_score(p2, &rss, &swp);
+}
+
+/*
+ *  oom_scope - find out what an allocation ran out of
+ *  @caller: allocating process
+ *  @nr: pages the allocation failed to get
+ *  @memcg: return the group to pick the victim in, NULL for any process
+ *  Return 1 if killing a process may make room, 0 if not
+ */
+static int oom_scope(struct pcb_t *caller, int nr, struct mem_cgroup **memcg)
+{
+  int own, group;
+
+  *memcg = NULL;
+  memcg_limit_room(caller->mm, &own, &group);
+  if (own < nr)
+    return 0;
+  if (group < nr)
+  {
+    *memcg = caller->mm->memcg;
+    return 1;
+  }
+
+  /* No limit in the way, MEMRAM has to be full too */
+  return MEMPHY_nr_free(caller->mram) < nr;
+}
+
+/*
+ *  oom_kill - kill a process to make room for an allocation
+ *  @caller: allocating process, its mm is locked
+ *  @nr: pages the allocation failed to get
+ *  Return 0 if another process was killed and the allocation may be
+ *  retried, -1 if the caller goes instead, killing would not make room
+ *  or the killer is off
+ */
+int oom_kill(struct pcb_t *caller, int nr)
+{
+  struct mem_cgroup *memcg;
+  struct pcb_t *victim;
+  int score, rss, swp, vscore, vrss, vswp;
+  char where[32] = "";
+
+  if (!oom_scope(caller, nr, &memcg))
+    return -1;
+
+  __atomic_fetch_add(&oom_nr_event, 1, __ATOMIC_RELAXED);
+  if (mm_oom_kill <= 0)
+    return -1;
+
+  if (memcg != NULL)
+  {
+    snprintf(where, sizeof(where), " in group %d", memcg->id);
+    __atomic_fetch_add(&oom_nr_group, 1, __ATOMIC_RELAXED);
+  }
+
+  score = oom_score(caller, &rss, &swp);
+  oom_memcg = memcg;
+  victim = take_proc(oom_better, caller);
+  oom_memcg = NULL;
+  if (victim == NULL)
+  {
+    printf("\tOOM: PID %2d needs %d pages%s, killed itself score=%d (resident=%d swapped=%d)\n",
+           caller->pid, nr, where, score, rss, swp);
+    __atomic_fetch_add(&oom_nr_self, 1, __ATOMIC_RELAXED);
+    caller->pc = caller->code->size;
+    return -1;
+  }
+
+  /* Not on any CPU nor queue any more, only background reclaim may
+   * hold its lock, and never waits for ours */
+  vscore = oom_score(victim, &vrss, &vswp);
+  printf("\tOOM: PID %2d needs %d pages%s score=%d, killed process %2d score=%d (resident=%d swapped=%d)\n",
+         caller->pid, nr, where, score, victim->pid, vscore, vrss, vswp);
+  free_pcb_memph(victim);
+  free(victim);
+  __atomic_fetch_add(&oom_nr_kill, 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+/*
+ *  oom_report - print the allocations that ran out of memory
+ */
+int oom_report(void)
+{
+  if (oom_nr_event == 0)
+    return 0;
+
+  printf("----------------OUT OF MEMORY-------------- \n");
+  printf("allocations out of RAM and swap=%ld (in a group at its limit=%ld) processes killed=%ld allocating processes ended=%ld%s\n",
+         oom_nr_event, oom_nr_group, oom_nr_kill, oom_nr_self, (mm_oom_kill > 0) ? "" : " (killer off)");
+
+  return 0;
+}
+#endif
@@ -0,0 +1,211 @@
+/*
+ * PAGING based Memory Management
+ * Page fault frequency control mm/mm-pff.c
+ *
+ * A controller runs once per time slot next to the CPUs and samples
+ * the page faults of every process against its memory accesses, which
+ * only advance while the process runs. A process faulting more often
+ * than mm_pff_high percent of its accesses gets a larger frame budget.
+ * While such a process finds MEMRAM short of free frames, one faulting
+ * less often than mm_pff_low percent gets a smaller budget and gives
+ * its pages over it back through the page replacement policy.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+#define PFF_MIN_ACCESS 8   /* accesses a sample needs to be taken */
+#define PFF_MIN_FRAMES 2   /* smallest budget */
+#define PFF_PRESSURE_DIV 8 /* pressure below 1/PFF_PRESSURE_DIV of MEMRAM free */
+
+int mm_pff_high = 0; /* 0 keeps the controller off */
+int mm_pff_low = 0;
+
+/* Sampling state of a live process */
+struct pff_entry {
+  struct mm_struct *mm;
+  int pid;
+  int last_fault;
+  int last_access;
+  int rate; /* faults per 100 accesses at the last sample, -1 before it */
+  struct pff_entry *next;
+};
+
+static struct pff_entry *pff_list;
+static pthread_mutex_t pff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics, updated under pff_lock */
+static long pff_nr_sample, pff_nr_grow, pff_nr_shrink, pff_nr_busy;
+static long pff_nr_reclaim, pff_nr_fail;
+static long pff_nr_fault, pff_nr_access; /* of finished processes */
+
+static int pff_step(int frames)
+{
+  return (frames / 4 > 0) ? frames / 4 : 1;
+}
+
+/*
+ *  pff_attach - put a new process under the controller
+ *  @mm: memory of the process
+ *  @pid: process ID, for the report
+ */
+void pff_attach(struct mm_struct *mm, int pid)
+{
+  struct pff_entry *pe;
+
+  mm->rss_pff = 0;
+  if (mm_pff_high <= 0)
+    return;
+
+  pe = malloc(sizeof(struct pff_entry));
+  pe->mm = mm;
+  pe->pid = pid;
+  pe->last_fault = pe->last_access = 0;
+  pe->rate = -1;
+
+  pthread_mutex_lock(&pff_lock);
+  pe->next = pff_list;
+  pff_list = pe;
+  pthread_mutex_unlock(&pff_lock);
+}
+
+/*
+ *  pff_detach - take a finishing process off the controller
+ *  @mm: memory of the process, not locked by the caller
+ */
+void pff_detach(struct mm_struct *mm)
+{
+  struct pff_entry **ppe, *pe = NULL;
+
+  pthread_mutex_lock(&pff_lock);
+  for (ppe = &pff_list; *ppe != NULL; ppe = &(*ppe)->next)
+    if ((*ppe)->mm == mm)
+    {
+      pe = *ppe;
+      *ppe = pe->next;
+      break;
+    }
+
+  /* Only the finishing process itself updates these counters. Its lock
+   * is not taken, fork attaches children with mm locks held */
+  if (pe != NULL)
+  {
+    pff_nr_fault += mm->pgfault;
+    pff_nr_access += mm->tlb_hit + mm->tlb_miss;
+  }
+  pthread_mutex_unlock(&pff_lock);
+
+  free(pe);
+}
+
+/*
+ *  pff_sample - adjust the budget of a process from its fault rate
+ *  @mram: MEMRAM
+ *  @pe: process, its mm is locked by the caller
+ *  @pressure: frames are wanted by faulting processes
+ */
+static void pff_sample(struct memphy_struct *mram, struct pff_entry *pe, int pressure)
+{
+  struct mm_struct *mm = pe->mm;
+  int access = mm->tlb_hit + mm->tlb_miss;
+  int rss, rate, budget, fpn;
+
+  /* A process that hardly ran since the last sample keeps accumulating */
+  if (access - pe->last_access < PFF_MIN_ACCESS)
+    return;
+
+  rate = 100 * (mm->pgfault - pe->last_fault) / (access - pe->last_access);
+  pe->rate = rate;
+  pe->last_fault = mm->pgfault;
+  pe->last_access = access;
+  pff_nr_sample++;
+
+  rss = __atomic_load_n(&mm->rss_charged, __ATOMIC_RELAXED);
+  if (rate > mm_pff_high)
+  { /* Only a budget the process runs into is worth raising */
+    if (mm->rss_pff > 0 && rss >= mm->rss_pff)
+    {
+      mm->rss_pff += pff_step(mm->rss_pff);
+      pff_nr_grow++;
+    }
+  }
+  else if (rate < mm_pff_low && pressure && rss > PFF_MIN_FRAMES)
+  {
+    budget = rss - pff_step(rss);
+    if (budget < PFF_MIN_FRAMES)
+      budget = PFF_MIN_FRAMES;
+    mm->rss_pff = budget;
+    pff_nr_shrink++;
+
+    while (__atomic_load_n(&mm->rss_charged, __ATOMIC_RELAXED) > budget)
+    {
+      if (pg_evict_own_frame(mram, mm, &fpn) < 0)
+      { /* Every mapper busy or swap full, retry next sample */
+        pff_nr_fail++;
+        break;
+      }
+      MEMPHY_put_freefp(mram, fpn);
+      pff_nr_reclaim++;
+    }
+  }
+}
+
+/*
+ *  pff_balance - sample every process and adjust its frame budget
+ *  @mram: MEMRAM
+ *  Called by the controller thread once per time slot
+ */
+int pff_balance(struct memphy_struct *mram)
+{
+  int numfp = mram->maxsz / PAGING_PAGESZ;
+  struct pff_entry *pe;
+  int pressure = 0;
+
+  /* Frames are only taken back for a process faulting above the high
+   * threshold at its last sample and with MEMRAM short of free frames */
+  pthread_mutex_lock(&pff_lock);
+  for (pe = pff_list; pe != NULL; pe = pe->next)
+    if (pe->rate > mm_pff_high)
+      pressure = 1;
+  if (MEMPHY_nr_free(mram) >= numfp / PFF_PRESSURE_DIV)
+    pressure = 0;
+
+  for (pe = pff_list; pe != NULL; pe = pe->next)
+  {
+    /* A process running on a CPU holds its lock, sample it later */
+    if (pthread_mutex_trylock(&pe->mm->lock) != 0)
+    {
+      pff_nr_busy++;
+      continue;
+    }
+    pff_sample(mram, pe, pressure);
+    pthread_mutex_unlock(&pe->mm->lock);
+  }
+  pthread_mutex_unlock(&pff_lock);
+
+  return 0;
+}
+
+/*
+ *  pff_report - print the budget adjustments and the faults they led to
+ */
+int pff_report(void)
+{
+  if (mm_pff_high <= 0)
+    return 0;
+
+  printf("----------------PAGE FAULT FREQUENCY-------------- \n");
+  printf("thresholds low=%d%% high=%d%% of accesses samples=%ld skipped busy=%ld\n",
+         mm_pff_low, mm_pff_high, pff_nr_sample, pff_nr_busy);
+  printf("budgets raised=%ld lowered=%ld frames reclaimed=%ld failed=%ld\n",
+         pff_nr_grow, pff_nr_shrink, pff_nr_reclaim, pff_nr_fail);
+  printf("page faults of all processes=%ld in %ld accesses (%.2f%%)\n",
+         pff_nr_fault, pff_nr_access,
+         pff_nr_access ? 100.0 * pff_nr_fault / pff_nr_access : 0.0);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,290 @@
+/*
+ * PAGING based Memory Management
+ * Page replacement policies mm/mm-repl.c
+ *
+ * Victims are picked on a ring of mapped MEMRAM frames, either the
+ * used_fp_list of MEMRAM (global scope) or the resident ring of the
+ * faulting mm (local scope). Both rings are circular, newest first,
+ * and every mapped page appears once. Referenced bits live in the PTE,
+ * clearing one also shoots the page out of the TLBs so that the next
+ * access walks the page table and marks the page again.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef MM_PAGING
+int mm_repl_policy = REPL_FIFO;
+
+static const char *repl_name[] = { "fifo", "second", "clock", "lru" };
+
+/* Statistics, updated under the fp_lock of MEMRAM */
+static long repl_nr_evict, repl_nr_fail, repl_nr_scan;
+static long repl_host_ns;
+
+#define RING_OLDER(fp, local) ((local) ? (fp)->mm_next : (fp)->fp_next)
+#define RING_NEWER(fp, local) ((local) ? (fp)->mm_prev : (fp)->fp_prev)
+
+/*
+ *  repl_parse_policy - get a policy from its configuration name
+ *  Return the policy, -1 if unknown
+ */
+int repl_parse_policy(const char *name)
+{
+  int i;
+
+  for (i = 0; i < (int)(sizeof(repl_name) / sizeof(repl_name[0])); i++)
+    if (!strcmp(name, repl_name[i]))
+      return i;
+
+  return -1;
+}
+
+/*
+ *  repl_test_clear_ref - consume the referenced bits of a mapped frame
+ *  A frame shared after fork is referenced through any of its PTEs
+ */
+static int repl_test_clear_ref(struct framephy_struct *fp)
+{
+  struct frame_map *map;
+  int ref = 0;
+
+  if (pte_test_clear_ref(&fp->owner->pgd[fp->pgn]))
+  {
+    tlb_invalidate(fp->owner, fp->pgn);
+    ref = 1;
+  }
+
+  for (map = fp->maps; map != NULL; map = map->next)
+    if (pte_test_clear_ref(&map->mm->pgd[map->pgn]))
+    {
+      tlb_invalidate(map->mm, map->pgn);
+      ref = 1;
+    }
+
+  return ref;
+}
+
+/*
+ *  repl_release_upto - unlock the mappers of a frame taken by repl_grab
+ *  @upto: first extra mapping left unlocked, NULL for all of them
+ */
+static void repl_release_upto(struct framephy_struct *fp, struct mm_struct *mm,
+                              struct frame_map *upto)
+{
+  struct frame_map *map;
+
+  if (fp->owner != mm)
+    pthread_mutex_unlock(&fp->owner->lock);
+
+  for (map = fp->maps; map != upto; map = map->next)
+    if (map->mm != mm)
+      pthread_mutex_unlock(&map->mm->lock);
+}
+
+static void repl_release(struct framephy_struct *fp, struct mm_struct *mm)
+{
+  repl_release_upto(fp, mm, NULL);
+}
+
+/*
+ *  repl_grab - lock every mapper of a candidate victim
+ *  The faulting mm is already locked, any other mapper busy on a CPU
+ *  makes the frame skipped rather than waited for
+ */
+static int repl_grab(struct framephy_struct *fp, struct mm_struct *mm)
+{
+  struct frame_map *map;
+
+  if (fp->owner != mm && pthread_mutex_trylock(&fp->owner->lock) != 0)
+    return 0;
+
+  for (map = fp->maps; map != NULL; map = map->next)
+    if (map->mm != mm && pthread_mutex_trylock(&map->mm->lock) != 0)
+    {
+      repl_release_upto(fp, mm, map);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ *  repl_fifo - oldest frame whose owner can be locked
+ */
+static struct framephy_struct *repl_fifo(struct framephy_struct *head,
+                                         int local, struct mm_struct *mm)
+{
+  struct framephy_struct *oldest = RING_NEWER(head, local);
+  struct framephy_struct *fp = oldest;
+
+  do {
+    repl_nr_scan++;
+    if (repl_grab(fp, mm))
+      return fp;
+    fp = RING_NEWER(fp, local);
+  } while (fp != oldest);
+
+  return NULL;
+}
+
+/*
+ *  repl_second - FIFO, a referenced oldest frame is requeued as newest
+ *  Requeuing the oldest frame of a circular ring is a rotation of its head
+ */
+static struct framephy_struct *repl_second(struct framephy_struct **head,
+                                           int local, struct mm_struct *mm)
+{
+  struct framephy_struct *start = RING_NEWER(*head, local);
+  struct framephy_struct *fp;
+  int pass = 0;
+
+  for (;;)
+  {
+    fp = RING_NEWER(*head, local);
+    if (fp == start && ++pass > 2)
+      return NULL; /* Every owner is busy */
+
+    repl_nr_scan++;
+    if (!repl_test_clear_ref(fp) && repl_grab(fp, mm))
+      return fp;
+    *head = fp;
+  }
+}
+
+/*
+ *  repl_clock - sweep a hand over the ring, clearing referenced bits
+ *  Unlike repl_second the ring order is left alone, the hand keeps
+ *  its position between two evictions
+ */
+static struct framephy_struct *repl_clock(struct framephy_struct *head,
+                                          struct framephy_struct **hand,
+                                          int local, struct mm_struct *mm)
+{
+  struct framephy_struct *start, *fp;
+  int pass = 0;
+
+  fp = start = (*hand != NULL) ? *hand : RING_NEWER(head, local);
+  for (;;)
+  {
+    repl_nr_scan++;
+    if (!repl_test_clear_ref(fp) && repl_grab(fp, mm))
+    {
+      *hand = RING_NEWER(fp, local);
+      return fp;
+    }
+
+    fp = RING_NEWER(fp, local);
+    if (fp == start && ++pass > 1)
+    {
+      *hand = fp;
+      return NULL;
+    }
+  }
+}
+
+/*
+ *  repl_lru - shift the referenced bits into the age of every frame and
+ *  pick the smallest age, the oldest frame wins a tie
+ */
+static struct framephy_struct *repl_lru(struct framephy_struct *head,
+                                        int local, struct mm_struct *mm)
+{
+  struct framephy_struct *oldest = RING_NEWER(head, local);
+  struct framephy_struct *fp, *best = NULL;
+
+  fp = oldest;
+  do {
+    repl_nr_scan++;
+    fp->age = (fp->age >> 1) | (repl_test_clear_ref(fp) ? 0x80 : 0);
+    fp = RING_NEWER(fp, local);
+  } while (fp != oldest);
+
+  fp = oldest;
+  do {
+    if ((best == NULL || fp->age < best->age) && repl_grab(fp, mm))
+    {
+      if (best != NULL)
+        repl_release(best, mm);
+      best = fp;
+      if (best->age == 0)
+        break;
+    }
+    fp = RING_NEWER(fp, local);
+  } while (fp != oldest);
+
+  return best;
+}
+
+/*
+ *  repl_select - choose a victim frame with the configured policy
+ *  @head: ring head, newest frame
+ *  @hand: clock hand of the ring
+ *  @local: ring linked through mm_next/mm_prev instead of fp_next/fp_prev
+ *  @mm: faulting mm, already locked
+ *  Caller holds the fp_lock of MEMRAM. The victim stays linked, its
+ *  owner and other mappers come back locked unless they are mm
+ */
+struct framephy_struct *repl_select(struct framephy_struct **head,
+                                    struct framephy_struct **hand,
+                                    int local, struct mm_struct *mm)
+{
+  struct framephy_struct *fp = NULL;
+  struct timespec t0, t1;
+
+  if (*head == NULL)
+    return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  switch (mm_repl_policy)
+  {
+  case REPL_SECOND:
+    fp = repl_second(head, local, mm);
+    break;
+  case REPL_CLOCK:
+    fp = repl_clock(*head, hand, local, mm);
+    break;
+  case REPL_LRU:
+    fp = repl_lru(*head, local, mm);
+    break;
+  default:
+    fp = repl_fifo(*head, local, mm);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  repl_host_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+  if (fp != NULL)
+    repl_nr_evict++;
+  else
+    repl_nr_fail++;
+
+  return fp;
+}
+
+/*
+ *  repl_report - print the cost of the page replacement policy
+ *  Host time differs from run to run, it is only printed under VMDBG
+ */
+int repl_report(void)
+{
+  if (repl_nr_evict == 0)
+    return 0;
+
+  printf("----------------PAGE REPLACEMENT-------------- \n");
+  printf("policy=%s scope=%s evictions=%ld failed=%ld\n",
+         repl_name[mm_repl_policy], mm_repl_global ? "global" : "local",
+         repl_nr_evict, repl_nr_fail);
+  printf("frames scanned=%ld (%.2f per eviction)\n",
+         repl_nr_scan, (double)repl_nr_scan / repl_nr_evict);
+#ifdef VMDBG
+  printf("host time=%ldns (%.0fns per eviction)\n",
+         repl_host_ns, (double)repl_host_ns / repl_nr_evict);
+#endif
+
+  return 0;
+}
+#endif
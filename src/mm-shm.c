@@ -0,0 +1,366 @@
+/*
+ * PAGING based Memory Management
+ * Shared memory segments mm/mm-shm.c
+ *
+ * A segment is named by an integer key and created by its first
+ * attach. Its pages belong to an anchor mm_struct that owns the frames
+ * in the MEMRAM reverse map, every attached process maps them as an
+ * extra mapper. A page of a segment is only ever brought in once for
+ * all its attachers, so the frame is counted once in MEMRAM whatever
+ * the number of processes sharing it.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+/* Segments are attached downward from the top of the address space */
+#define PAGING_SHM_TOP BIT(PAGING_CPU_BUS_WIDTH)
+
+static struct shm_segment *shm_list;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics, updated under shm_lock */
+static long shm_nr_create, shm_nr_attach, shm_nr_destroy;
+static long shm_nr_fault_shared, shm_nr_fault_in;
+
+/*
+ *  shm_get - attach to the segment of a key, create it on first use
+ *  @key: segment name
+ *  @size: bytes the attacher needs, must fit an existing segment
+ *  Return the segment, NULL if it is too small or the size is invalid
+ */
+struct shm_segment *shm_get(int key, int size)
+{
+  struct shm_segment *seg;
+  int npages = DIV_ROUND_UP(size, PAGING_PAGESZ);
+
+  if (size <= 0 || npages > PAGING_MAX_PGN)
+    return NULL;
+
+  pthread_mutex_lock(&shm_lock);
+  for (seg = shm_list; seg != NULL; seg = seg->next)
+    if (seg->key == key)
+      break;
+
+  if (seg != NULL)
+  {
+    if (npages > seg->npages)
+      seg = NULL;
+    else
+    {
+      seg->nattach++;
+      shm_nr_attach++;
+    }
+    pthread_mutex_unlock(&shm_lock);
+    return seg;
+  }
+
+  seg = malloc(sizeof(struct shm_segment));
+  seg->key = key;
+  seg->npages = npages;
+  seg->nattach = 1;
+
+  /* The anchor only has a page table, it never runs nor faults */
+  seg->mm.pgd = calloc(npages, sizeof(pte_t));
+  seg->mm.mmap = NULL;
+  seg->mm.vmatbl = NULL;
+  seg->mm.vmatbl_sz = 0;
+  seg->mm.symrgtbl = NULL;
+  seg->mm.symrgtbl_sz = 0;
+  seg->mm.resident = NULL;
+  seg->mm.clock_hand = NULL;
+  pthread_mutex_init(&seg->mm.lock, NULL);
+  seg->mm.tlb_hit = seg->mm.tlb_miss = 0;
+  seg->mm.pgfault = seg->mm.pgzero = seg->mm.cowfault = 0;
+  seg->mm.ra_next = -1;
+  seg->mm.ra_win = 0;
+  seg->mm.memcg = NULL;
+  seg->mm.rss_charged = seg->mm.rss_peak = seg->mm.rss_evict = 0;
+  seg->mm.rss_max = 0;
+  seg->mm.rss_pff = 0;
+  seg->mm.swapper_fault = seg->mm.swapper_access = 0;
+  seg->mm.pgretry = 0;
+
+  seg->next = shm_list;
+  shm_list = seg;
+  shm_nr_create++;
+  shm_nr_attach++;
+  pthread_mutex_unlock(&shm_lock);
+
+  return seg;
+}
+
+/*
+ *  shm_dup - attach a forked child to a segment of its parent
+ */
+void shm_dup(struct shm_segment *seg)
+{
+  pthread_mutex_lock(&shm_lock);
+  seg->nattach++;
+  shm_nr_attach++;
+  pthread_mutex_unlock(&shm_lock);
+}
+
+/*
+ *  shm_put - detach from a segment, the last one out destroys it
+ *  @seg: segment
+ *  @mram: MEMRAM holding its frames
+ *  The caller already dropped the mappings of its own PTEs
+ */
+void shm_put(struct shm_segment *seg, struct memphy_struct *mram)
+{
+  struct shm_segment **pseg;
+  struct framephy_struct *fp;
+  pte_t pte;
+  int left, idx;
+
+  pthread_mutex_lock(&shm_lock);
+  left = --seg->nattach;
+  if (left == 0)
+  {
+    for (pseg = &shm_list; *pseg != seg; pseg = &(*pseg)->next)
+      ;
+    *pseg = seg->next;
+    shm_nr_destroy++;
+  }
+  pthread_mutex_unlock(&shm_lock);
+
+  if (left > 0)
+    return;
+
+  /* An eviction may still be fixing up the anchor, it holds its lock */
+  pthread_mutex_lock(&seg->mm.lock);
+  for (idx = 0; idx < seg->npages; idx++)
+  {
+    pte = __atomic_load_n(&seg->mm.pgd[idx], __ATOMIC_RELAXED);
+    if (!PAGING_PTE_PAGE_PRESENT(pte))
+      continue;
+
+    if (pte & PAGING_PTE_SWAPPED_MASK)
+    {
+      swap_put_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+      continue;
+    }
+
+    fp = &mram->frmtbl[PAGING_PTE_FPN(pte)];
+    if (MEMPHY_unshare_usedfp(mram, fp->fpn, &seg->mm, idx) == 0)
+    {
+      if (fp->swpoff >= 0)
+      {
+        swap_put_slot(fp->swptyp, fp->swpoff);
+        fp->swpoff = -1;
+      }
+      MEMPHY_put_freefp(mram, fp->fpn);
+    }
+  }
+  pthread_mutex_unlock(&seg->mm.lock);
+
+  pthread_mutex_destroy(&seg->mm.lock);
+  free(seg->mm.pgd);
+  free(seg);
+}
+
+/*
+ *  shm_find_vma - get the segment attachment covering an address
+ *  @mm: memory region
+ *  @addr: virtual address
+ */
+struct vm_area_struct *shm_find_vma(struct mm_struct *mm, int addr)
+{
+  struct vm_area_struct *vma;
+
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    if (vma->vm_shm != NULL && vma->vm_start <= addr && addr < vma->vm_end)
+      return vma;
+
+  return NULL;
+}
+
+/*
+ *  shm_account_fault - count a fault on a segment page
+ *  @resident: 1 if another attacher already had the frame in MEMRAM
+ */
+void shm_account_fault(int resident)
+{
+  pthread_mutex_lock(&shm_lock);
+  if (resident)
+    shm_nr_fault_shared++;
+  else
+    shm_nr_fault_in++;
+  pthread_mutex_unlock(&shm_lock);
+}
+
+/*__shmat - attach a shared memory segment
+ *@caller: caller, its mm is locked
+ *@key: segment name
+ *@size: bytes of the segment used through the region
+ *@rgid: memory region ID bound to the segment
+ *
+ * The segment gets a VMA of its own below the lowest attached segment.
+ * Its PTEs are only marked, the pages are mapped by their first access.
+ */
+int __shmat(struct pcb_t *caller, int key, int size, int rgid)
+{
+  struct mm_struct *mm = caller->mm;
+  struct vm_area_struct *vma, **pvma;
+  struct vm_rg_struct *sym_rg = alloc_symrg_byid(mm, rgid);
+  struct shm_segment *seg;
+  unsigned long top = PAGING_SHM_TOP;
+  int vmaid = 0, pgn, pgend;
+
+  if (sym_rg == NULL)
+    return -1;
+
+  if ((seg = shm_get(key, size)) == NULL)
+  {
+    printf("ERROR: shared memory segment %d cannot hold %d bytes\n", key, size);
+    return -1;
+  }
+
+  for (pvma = &mm->mmap; *pvma != NULL; pvma = &(*pvma)->vm_next)
+  {
+    if ((int)(*pvma)->vm_id >= vmaid)
+      vmaid = (*pvma)->vm_id + 1;
+    if ((*pvma)->vm_shm != NULL && (*pvma)->vm_start < top)
+      top = (*pvma)->vm_start;
+  }
+
+  if (top < (unsigned long)seg->npages * PAGING_PAGESZ ||
+      validate_overlap_vm_area(caller, vmaid, top - seg->npages * PAGING_PAGESZ, top) < 0)
+  {
+    printf("Overlaped vm_area regions\n");
+    shm_put(seg, caller->mram);
+    return -1;
+  }
+
+  vma = malloc(sizeof(struct vm_area_struct));
+  vma->vm_id = vmaid;
+  vma->vm_start = top - seg->npages * PAGING_PAGESZ;
+  vma->vm_end = top;
+  vma->sbrk = top;
+  vma->vm_grow = 0;
+  vma->vm_used = top;
+  vma->vm_mm = mm;
+  vma->vm_freerg[FREERG_BY_ADDR] = vma->vm_freerg[FREERG_BY_SIZE] = NULL;
+  vma->vm_next = NULL;
+  vma->vm_shm = seg;
+  *pvma = vma;
+  set_vma_by_num(mm, vmaid, vma);
+
+  pgend = PAGING_PGN((vma->vm_end - 1));
+  for (pgn = PAGING_PGN(vma->vm_start); pgn <= pgend; pgn++)
+    mm->pgd[pgn] = PAGING_PTE_SHM_MASK;
+
+  sym_rg->rg_start = vma->vm_start;
+  sym_rg->rg_end = vma->vm_start + size;
+  sym_rg->vmaid = vmaid;
+
+  return 0;
+}
+
+/*__shmdt - detach the shared memory segment bound to a region
+ *@caller: caller, its mm is locked
+ *@rgid: memory region ID given to __shmat
+ *
+ */
+int __shmdt(struct pcb_t *caller, int rgid)
+{
+  struct mm_struct *mm = caller->mm;
+  struct vm_rg_struct *sym_rg = get_symrg_byid(mm, rgid);
+  struct vm_area_struct *vma = NULL, **pvma;
+  struct shm_segment *seg;
+  pte_t pte;
+  int pgn, pgend;
+
+  if (sym_rg != NULL && sym_rg->rg_start < sym_rg->rg_end)
+    vma = get_vma_by_num(mm, sym_rg->vmaid);
+
+  if (vma == NULL || vma->vm_shm == NULL)
+  {
+    printf("ERROR: region %d is not a shared memory segment\n", rgid);
+    return -1;
+  }
+
+  /* Our frames stay with the segment, our swap references go */
+  pgend = PAGING_PGN((vma->vm_end - 1));
+  for (pgn = PAGING_PGN(vma->vm_start); pgn <= pgend; pgn++)
+  {
+    pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+    if (PAGING_PTE_PAGE_PRESENT(pte))
+    {
+      if (pte & PAGING_PTE_SWAPPED_MASK)
+        swap_put_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+      else
+      {
+        MEMPHY_unshare_usedfp(caller->mram, PAGING_PTE_FPN(pte), mm, pgn);
+        tlb_invalidate(mm, pgn);
+      }
+    }
+    mm->pgd[pgn] = 0;
+  }
+
+  seg = vma->vm_shm;
+  for (pvma = &mm->mmap; *pvma != vma; pvma = &(*pvma)->vm_next)
+    ;
+  *pvma = vma->vm_next;
+  set_vma_by_num(mm, vma->vm_id, NULL);
+  free(vma);
+
+  sym_rg->rg_start = sym_rg->rg_end = 0;
+  shm_put(seg, caller->mram);
+
+  return 0;
+}
+
+/*pgshmat - PAGING-based attach of a shared memory segment
+ *@proc: Process executing the instruction
+ *@key: segment name
+ *@size: segment size, used when the segment is created
+ *@reg_index: memory region ID bound to the segment
+ */
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t size, uint32_t reg_index)
+{
+  int ret;
+
+  pthread_mutex_lock(&proc->mm->lock);
+  ret = __shmat(proc, key, size, reg_index);
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return ret;
+}
+
+/*pgshmdt - PAGING-based detach of a shared memory segment
+ *@proc: Process executing the instruction
+ *@reg_index: memory region ID bound to the segment
+ */
+int pgshmdt(struct pcb_t *proc, uint32_t reg_index)
+{
+  int ret;
+
+  pthread_mutex_lock(&proc->mm->lock);
+  ret = __shmdt(proc, reg_index);
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return ret;
+}
+
+/*
+ *  shm_report - print how much RAM sharing saved
+ */
+int shm_report(void)
+{
+  if (shm_nr_create == 0)
+    return 0;
+
+  printf("----------------SHARED MEMORY-------------- \n");
+  printf("segments created=%ld destroyed=%ld attaches=%ld\n",
+         shm_nr_create, shm_nr_destroy, shm_nr_attach);
+  printf("faults mapped a resident frame=%ld brought a page in=%ld\n",
+         shm_nr_fault_shared, shm_nr_fault_in);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,233 @@
+/*
+ * PAGING based Memory Management
+ * Swap manager mm/mm-swap.c
+ *
+ * Hand out swap slots across every configured MEMSWP device.
+ * Devices are grouped in priority tiers (higher first), a tier is
+ * only used once every device of the higher tiers is full and the
+ * devices inside a tier are striped round-robin.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+static struct swap_info_struct swap_info[PAGING_MAX_MMSWP]; /* sorted by prio */
+static int nr_swap;
+static struct memphy_struct *swap_devs[PAGING_MAX_MMSWP];   /* indexed by SWPTYP */
+static int swap_rr[PAGING_MAX_MMSWP];                       /* rr cursor per tier head */
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static long swap_nr_written, swap_nr_clean; /* page outs written or dropped clean */
+
+/*
+ *  init_swap - register swap devices to the swap manager
+ *  @mswp: array of swap devices, index is the swap type
+ *  @prio: priority of each device
+ *  @nswp: number of devices
+ *  Devices too small to hold a frame are skipped
+ */
+int init_swap(struct memphy_struct *mswp, int *prio, int nswp)
+{
+  int sit, pos;
+
+  nr_swap = 0;
+  for (sit = 0; sit < nswp && sit < PAGING_MAX_MMSWP; sit++)
+  {
+    swap_devs[sit] = &mswp[sit];
+    if (mswp[sit].maxsz < PAGING_PAGESZ)
+      continue;
+
+    /* Insertion keeps equal priorities in device order */
+    pos = nr_swap;
+    while (pos > 0 && swap_info[pos - 1].prio < prio[sit])
+    {
+      swap_info[pos] = swap_info[pos - 1];
+      pos--;
+    }
+
+    swap_info[pos].type = sit;
+    swap_info[pos].prio = prio[sit];
+    swap_info[pos].mp = &mswp[sit];
+    swap_info[pos].nframes = mswp[sit].maxsz / PAGING_PAGESZ;
+    swap_info[pos].inuse = 0;
+    swap_info[pos].peak = 0;
+    swap_info[pos].nr_out = 0;
+    swap_info[pos].slot_ref = calloc(swap_info[pos].nframes, sizeof(unsigned short));
+    nr_swap++;
+  }
+
+  return (nr_swap > 0) ? 0 : -1;
+}
+
+/*
+ *  swap_dev - get the MEMSWP device of a swap type
+ */
+struct memphy_struct *swap_dev(int swptyp)
+{
+  if (swptyp < 0 || swptyp >= PAGING_MAX_MMSWP)
+    return NULL;
+
+  return swap_devs[swptyp];
+}
+
+/*
+ *  swap_get_slot - allocate a swap slot
+ *  @swptyp: returned swap type (device index)
+ *  @swpoff: returned swap offset (frame in the device)
+ */
+int swap_get_slot(int *swptyp, int *swpoff)
+{
+  int tier, end, start, i, nr;
+  struct swap_info_struct *si;
+
+  for (tier = 0; tier < nr_swap; tier = end)
+  {
+    end = tier + 1;
+    while (end < nr_swap && swap_info[end].prio == swap_info[tier].prio)
+      end++;
+    nr = end - tier;
+
+    pthread_mutex_lock(&swap_lock);
+    start = swap_rr[tier]++ % nr;
+    pthread_mutex_unlock(&swap_lock);
+
+    for (i = 0; i < nr; i++)
+    {
+      si = &swap_info[tier + (start + i) % nr];
+      if (MEMPHY_get_freefp(si->mp, swpoff) == 0)
+      {
+        pthread_mutex_lock(&swap_lock);
+        si->slot_ref[*swpoff] = 1;
+        si->nr_out++;
+        if (++si->inuse > si->peak)
+          si->peak = si->inuse;
+        pthread_mutex_unlock(&swap_lock);
+
+        *swptyp = si->type;
+        return 0;
+      }
+    }
+  }
+
+  return -1; /* Every swap device is full */
+}
+
+/*
+ *  swap_info_of - get the swap manager entry of a swap type
+ */
+static struct swap_info_struct *swap_info_of(int swptyp)
+{
+  int i;
+
+  for (i = 0; i < nr_swap; i++)
+    if (swap_info[i].type == swptyp)
+      return &swap_info[i];
+
+  return NULL;
+}
+
+/*
+ *  swap_put_slot - drop a reference to a swap slot
+ *  @swptyp: swap type (device index)
+ *  @swpoff: swap offset
+ *  The slot is released with its last reference
+ */
+int swap_put_slot(int swptyp, int swpoff)
+{
+  struct swap_info_struct *si = swap_info_of(swptyp);
+  int ref;
+
+  if (si == NULL)
+    return -1;
+
+  pthread_mutex_lock(&swap_lock);
+  ref = --si->slot_ref[swpoff];
+  if (ref == 0)
+    si->inuse--;
+  pthread_mutex_unlock(&swap_lock);
+
+  if (ref > 0)
+    return 0;
+
+  /* A pooled copy of the slot content is stale from now on */
+  zswap_invalidate(swptyp, swpoff);
+
+  return MEMPHY_put_freefp(si->mp, swpoff);
+}
+
+/*
+ *  swap_dup_slot - take one more reference to a swap slot
+ *  A forked child maps the swapped pages of its parent this way
+ */
+int swap_dup_slot(int swptyp, int swpoff)
+{
+  struct swap_info_struct *si = swap_info_of(swptyp);
+
+  if (si == NULL)
+    return -1;
+
+  pthread_mutex_lock(&swap_lock);
+  si->slot_ref[swpoff]++;
+  pthread_mutex_unlock(&swap_lock);
+
+  return 0;
+}
+
+/*
+ *  swap_slot_shared - check if a slot is referred to more than once
+ *  A shared slot must not be rewritten in place
+ */
+int swap_slot_shared(int swptyp, int swpoff)
+{
+  struct swap_info_struct *si = swap_info_of(swptyp);
+  int ret;
+
+  if (si == NULL)
+    return 0;
+
+  pthread_mutex_lock(&swap_lock);
+  ret = si->slot_ref[swpoff] > 1;
+  pthread_mutex_unlock(&swap_lock);
+
+  return ret;
+}
+
+/*
+ *  swap_account_pageout - count a page leaving MEMRAM
+ *  @written: 1 if it was written to swap, 0 if its slot copy was still good
+ */
+void swap_account_pageout(int written)
+{
+  pthread_mutex_lock(&swap_lock);
+  if (written)
+    swap_nr_written++;
+  else
+    swap_nr_clean++;
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/*
+ *  swap_report - print usage of each swap device, if any slot was used
+ */
+int swap_report(void)
+{
+  int i, peak = 0;
+
+  for (i = 0; i < nr_swap; i++)
+    peak += swap_info[i].peak;
+  if (peak == 0)
+    return 0;
+
+  printf("----------------SWAP DEVICES-------------- \n");
+  for (i = 0; i < nr_swap; i++)
+    printf("MEMSWP%d: prio=%d slots=%d inuse=%d peak=%d swapouts=%d\n",
+           swap_info[i].type, swap_info[i].prio, swap_info[i].nframes,
+           swap_info[i].inuse, swap_info[i].peak, swap_info[i].nr_out);
+  printf("pageouts written=%ld clean dropped=%ld (swap traffic saved %ld bytes)\n",
+         swap_nr_written, swap_nr_clean, swap_nr_clean * PAGING_PAGESZ);
+
+  return 0;
+}
+#endif
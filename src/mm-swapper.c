@@ -0,0 +1,299 @@
+/*
+ * PAGING based Memory Management
+ * Medium-term scheduler mm/mm-swapper.c
+ *
+ * Load control against thrashing. A CPU folds the faults a process
+ * took to read pages back from swap into a system wide rate every time
+ * the process leaves it. The swapper runs once per time slot next to
+ * the CPUs. While the rate stays above mm_swapper_high percent of the
+ * accesses, it suspends a ready process out of the scheduler, the
+ * lowest priority and largest resident set first, and swaps out its
+ * pages mm_swapper_batch frames per time slot. Once the rate is down to
+ * mm_swapper_low and MEMRAM has room for the frames it had, the longest
+ * suspended process goes back to the ready queue.
+ */
+
+#include "mm.h"
+#include "sched.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+#define SWAPPER_MIN_ACCESS 16 /* accesses a sample needs to be taken */
+#define SWAPPER_SUSTAIN 3     /* samples in a row above the high threshold */
+#define SWAPPER_MIN_SLOTS 8   /* time slots a process stays suspended at least */
+#define SWAPPER_NR_TRACE 64   /* changes of the multiprogramming level kept */
+
+int mm_swapper_high = 0;  /* 0 keeps the swapper off */
+int mm_swapper_low = -1;  /* -1 for half of mm_swapper_high */
+int mm_swapper_batch = 4;
+
+/* Suspended process, oldest first like the suspend queue */
+struct swapper_entry {
+  struct pcb_t *proc;
+  int rss;    /* resident frames when suspended, wanted free to resume */
+  long since; /* time slot of the suspension */
+  struct swapper_entry *next;
+};
+
+/* Only used by the swapper thread */
+static struct swapper_entry *swapper_list;
+static int swapper_nr_susp;
+static long swapper_slot;
+static long swapper_last_fault, swapper_last_access;
+static int swapper_rate;    /* swap-ins per 100 accesses at the last sample */
+static int swapper_nr_high; /* samples in a row above the high threshold */
+
+/* Folded in by the CPUs */
+static long swapper_nr_fault, swapper_nr_access;
+static int swapper_nr_live; /* processes loaded or forked, not finished */
+
+/* Statistics */
+static long swapper_nr_suspend, swapper_nr_resume, swapper_nr_out, swapper_nr_fail;
+static long swapper_nr_slot, swapper_mpl_sum;
+static int swapper_mpl_max;
+static struct {
+  long slot;
+  int mpl;
+} swapper_trace[SWAPPER_NR_TRACE];
+static int swapper_nr_trace;
+static long swapper_nr_untraced;
+
+/*
+ *  swapper_attach - count a new process in the multiprogramming level
+ *  @mm: memory of the process
+ */
+void swapper_attach(struct mm_struct *mm)
+{
+  mm->swapper_fault = mm->swapper_access = 0;
+  if (mm_swapper_high <= 0)
+    return;
+
+  __atomic_fetch_add(&swapper_nr_live, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  swapper_account - fold the swap-ins and accesses of a process
+ *  @mm: memory of the process leaving the CPU of the caller
+ */
+void swapper_account(struct mm_struct *mm)
+{
+  int fault = mm->pgfault - mm->pgzero;
+  int access = mm->tlb_hit + mm->tlb_miss;
+
+  if (mm_swapper_high <= 0)
+    return;
+
+  __atomic_fetch_add(&swapper_nr_fault, fault - mm->swapper_fault, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&swapper_nr_access, access - mm->swapper_access, __ATOMIC_RELAXED);
+  mm->swapper_fault = fault;
+  mm->swapper_access = access;
+}
+
+/*
+ *  swapper_detach - take a finishing process out of the multiprogramming level
+ *  @mm: memory of the process, called from its CPU
+ */
+void swapper_detach(struct mm_struct *mm)
+{
+  if (mm_swapper_high <= 0)
+    return;
+
+  swapper_account(mm);
+  __atomic_fetch_sub(&swapper_nr_live, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  swapper_better - compare victims for suspension
+ *  Return nonzero if p1 has a lower priority than p2, or the same one
+ *  and more frames resident
+ */
+static int swapper_better(struct pcb_t *p1, struct pcb_t *p2)
+{
+#ifdef MLQ_SCHED
+  if (p1->prio != p2->prio)
+    return p1->prio > p2->prio;
+#else
+  if (p1->priority != p2->priority)
+    return p1->priority < p2->priority;
+#endif
+  return __atomic_load_n(&p1->mm->rss_charged, __ATOMIC_RELAXED) >
+         __atomic_load_n(&p2->mm->rss_charged, __ATOMIC_RELAXED);
+}
+
+/*
+ *  swapper_suspend - take a ready process out of the scheduler
+ */
+static void swapper_suspend(void)
+{
+  struct swapper_entry *se, **pse;
+  struct pcb_t *proc;
+
+  proc = suspend_proc(swapper_better);
+  if (proc == NULL)
+    return;
+
+  se = malloc(sizeof(struct swapper_entry));
+  se->proc = proc;
+  se->rss = __atomic_load_n(&proc->mm->rss_charged, __ATOMIC_RELAXED);
+  se->since = swapper_slot;
+  se->next = NULL;
+  for (pse = &swapper_list; *pse != NULL; pse = &(*pse)->next)
+    ;
+  *pse = se;
+  swapper_nr_susp++;
+  swapper_nr_suspend++;
+
+  printf("\tSwapper: Suspended process %2d, %d frames resident\n", proc->pid, se->rss);
+}
+
+/*
+ *  swapper_resume - put the longest suspended process back to ready queue
+ */
+static void swapper_resume(void)
+{
+  struct swapper_entry *se = swapper_list;
+  struct pcb_t *proc;
+
+  proc = resume_proc();
+  if (proc == NULL)
+    return;
+
+  swapper_list = se->next;
+  swapper_nr_susp--;
+  swapper_nr_resume++;
+  free(se);
+
+  printf("\tSwapper: Resumed process %2d\n", proc->pid);
+}
+
+/*
+ *  swapper_swapout - swap out the pages of suspended processes
+ *  @mram: MEMRAM
+ *  At most mm_swapper_batch frames are freed per time slot, the oldest
+ *  suspension first
+ */
+static void swapper_swapout(struct memphy_struct *mram)
+{
+  struct swapper_entry *se;
+  struct mm_struct *mm;
+  int budget = mm_swapper_batch, nr;
+
+  for (se = swapper_list; se != NULL && budget > 0; se = se->next)
+  {
+    mm = se->proc->mm;
+    if (__atomic_load_n(&mm->rss_charged, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    /* Background reclaim may be evicting one of its pages */
+    if (pthread_mutex_trylock(&mm->lock) != 0)
+      continue;
+    nr = pg_swapout_mm(mram, mm, budget);
+    if (nr < budget && __atomic_load_n(&mm->rss_charged, __ATOMIC_RELAXED) > 0)
+      swapper_nr_fail++; /* every mapper busy or swap full, retry next slot */
+    pthread_mutex_unlock(&mm->lock);
+
+    swapper_nr_out += nr;
+    budget -= nr;
+  }
+}
+
+/*
+ *  swapper_record - keep the multiprogramming level of this time slot
+ */
+static void swapper_record(int mpl, int live)
+{
+  if (live > 0)
+  {
+    swapper_nr_slot++;
+    swapper_mpl_sum += mpl;
+    if (mpl > swapper_mpl_max)
+      swapper_mpl_max = mpl;
+  }
+
+  if (swapper_nr_trace > 0 && swapper_trace[swapper_nr_trace - 1].mpl == mpl)
+    return;
+  if (swapper_nr_trace == SWAPPER_NR_TRACE)
+  {
+    swapper_nr_untraced++;
+    return;
+  }
+  swapper_trace[swapper_nr_trace].slot = swapper_slot;
+  swapper_trace[swapper_nr_trace].mpl = mpl;
+  swapper_nr_trace++;
+}
+
+/*
+ *  swapper_balance - suspend or resume a process from the swap-in rate
+ *  @mram: MEMRAM
+ *  Called by the swapper thread once per time slot
+ */
+int swapper_balance(struct memphy_struct *mram)
+{
+  long fault = __atomic_load_n(&swapper_nr_fault, __ATOMIC_RELAXED);
+  long access = __atomic_load_n(&swapper_nr_access, __ATOMIC_RELAXED);
+  int low = (mm_swapper_low >= 0) ? mm_swapper_low : mm_swapper_high / 2;
+  int live, mpl;
+
+  /* The CPUs fold their processes in at the end of their time slices */
+  if (access - swapper_last_access >= SWAPPER_MIN_ACCESS)
+  {
+    swapper_rate = 100 * (fault - swapper_last_fault) / (access - swapper_last_access);
+    swapper_last_fault = fault;
+    swapper_last_access = access;
+    swapper_nr_high = (swapper_rate > mm_swapper_high) ? swapper_nr_high + 1 : 0;
+  }
+
+  live = __atomic_load_n(&swapper_nr_live, __ATOMIC_RELAXED);
+  mpl = live - swapper_nr_susp;
+
+  /* The last process left running is never suspended, and a process
+   * is resumed whatever the rate once none is left */
+  if (swapper_nr_high >= SWAPPER_SUSTAIN && mpl > 1)
+  {
+    swapper_suspend();
+    swapper_nr_high = 0;
+  }
+  else if (swapper_list != NULL &&
+           (mpl <= 0 ||
+            (swapper_rate <= low && swapper_slot - swapper_list->since >= SWAPPER_MIN_SLOTS &&
+             MEMPHY_nr_free(mram) >= swapper_list->rss)))
+    swapper_resume();
+
+  swapper_swapout(mram);
+
+  swapper_record(live - swapper_nr_susp, live);
+  swapper_slot++;
+  return 0;
+}
+
+/*
+ *  swapper_report - print the suspensions and the multiprogramming level over time
+ */
+int swapper_report(void)
+{
+  int i;
+
+  if (mm_swapper_high <= 0)
+    return 0;
+
+  printf("----------------MEDIUM-TERM SCHEDULER-------------- \n");
+  printf("thresholds low=%d%% high=%d%% of accesses swapped in, swap out batch=%d frames\n",
+         (mm_swapper_low >= 0) ? mm_swapper_low : mm_swapper_high / 2, mm_swapper_high,
+         mm_swapper_batch);
+  printf("processes suspended=%ld resumed=%ld frames swapped out=%ld failed=%ld\n",
+         swapper_nr_suspend, swapper_nr_resume, swapper_nr_out, swapper_nr_fail);
+  printf("multiprogramming level max=%d mean=%.2f over %ld slots\n",
+         swapper_mpl_max, swapper_nr_slot ? (double)swapper_mpl_sum / swapper_nr_slot : 0.0,
+         swapper_nr_slot);
+  printf("multiprogramming level over time (slot:level):");
+  for (i = 0; i < swapper_nr_trace; i++)
+    printf(" %ld:%d", swapper_trace[i].slot, swapper_trace[i].mpl);
+  if (swapper_nr_untraced > 0)
+    printf(" ... %ld more changes", swapper_nr_untraced);
+  printf("\n");
+
+  return 0;
+}
+#endif
@@ -0,0 +1,225 @@
+/*
+ * PAGING based Memory Management
+ * Software TLB mm/mm-tlb.c
+ *
+ * Each CPU owns a direct mapped TLB caching (mm, pgn) -> fpn. Entries
+ * are tagged with their mm (the ASID), so a context switch keeps them.
+ * An entry is shot down on every CPU when its page leaves MEMRAM and
+ * all entries of a mm are dropped when the process exits. A huge page
+ * takes a single entry, in the slot of its head page.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+struct tlb_entry {
+  struct mm_struct *mm; /* ASID, NULL if the entry is invalid */
+  int pgn;
+  int fpn;
+  int writable; /* page dirty in the PTE and not copy-on-write */
+  int span;     /* pages mapped, mm_huge_pgn for a huge page */
+};
+
+struct tlb_struct {
+  /* Only contended by shootdowns coming from other CPUs */
+  pthread_mutex_t lock;
+  struct tlb_entry ent[TLB_NR_ENTRY];
+  int reach; /* pages mapped by the valid entries */
+};
+
+static struct tlb_struct tlb[MEMPHY_MAX_CPU];
+static pthread_once_t tlb_once = PTHREAD_ONCE_INIT;
+
+/* Statistics */
+static long tlb_nr_huge_hit;
+static int tlb_peak_reach;
+
+static void tlb_init(void)
+{
+  int cpu;
+
+  for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+    pthread_mutex_init(&tlb[cpu].lock, NULL);
+}
+
+static struct tlb_entry *tlb_slot(struct tlb_struct *t, struct mm_struct *mm, int pgn)
+{
+  unsigned long asid = (unsigned long)mm >> 4;
+
+  return &t->ent[(pgn ^ asid) % TLB_NR_ENTRY];
+}
+
+/*
+ *  tlb_drop - invalidate an entry, caller holds the lock of its TLB
+ */
+static void tlb_drop(struct tlb_struct *t, struct tlb_entry *te)
+{
+  if (te->mm == NULL)
+    return;
+
+  te->mm = NULL;
+  t->reach -= te->span;
+}
+
+/*
+ *  tlb_huge_slot - entry of the huge page covering a page, NULL if none
+ */
+static struct tlb_entry *tlb_huge_slot(struct tlb_struct *t, struct mm_struct *mm, int pgn)
+{
+  struct tlb_entry *te;
+  int head;
+
+  if (mm_huge_pgn == 0)
+    return NULL;
+
+  head = pgn & ~(mm_huge_pgn - 1);
+  te = tlb_slot(t, mm, head);
+  if (te->mm == mm && te->pgn == head && te->span > 1)
+    return te;
+
+  return NULL;
+}
+
+/*
+ *  tlb_lookup - translate a page through the TLB of the running CPU
+ *  @mm: address space
+ *  @pgn: page number
+ *  @write: access is a write
+ *  @fpn: return frame number
+ *  Return 0 on hit, -1 on miss. Hit and miss are counted in mm. A write
+ *  through an entry of a clean or copy-on-write page misses so the page
+ *  table walk marks it dirty or copies it
+ */
+int tlb_lookup(struct mm_struct *mm, int pgn, int write, int *fpn)
+{
+  int cpu = MEMPHY_get_cpu();
+  struct tlb_struct *t;
+  struct tlb_entry *te;
+  int ret = -1;
+
+  if (cpu >= 0)
+  {
+    pthread_once(&tlb_once, tlb_init);
+    t = &tlb[cpu];
+
+    pthread_mutex_lock(&t->lock);
+    te = tlb_slot(t, mm, pgn);
+    if (te->mm == mm && te->pgn == pgn && te->span == 1 && (!write || te->writable))
+    {
+      *fpn = te->fpn;
+      ret = 0;
+    }
+    else if ((te = tlb_huge_slot(t, mm, pgn)) != NULL && (!write || te->writable))
+    {
+      *fpn = te->fpn + (pgn - te->pgn);
+      ret = 0;
+      __atomic_fetch_add(&tlb_nr_huge_hit, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&t->lock);
+  }
+
+  if (ret == 0)
+    mm->tlb_hit++;
+  else
+    mm->tlb_miss++;
+
+  return ret;
+}
+
+/*
+ *  tlb_insert - cache a translation resolved by the page table walk
+ *  @huge: page is part of a huge page, the entry maps all of it
+ */
+void tlb_insert(struct mm_struct *mm, int pgn, int fpn, int writable, int huge)
+{
+  int cpu = MEMPHY_get_cpu();
+  struct tlb_struct *t;
+  struct tlb_entry *te;
+  int span = 1, peak;
+
+  if (cpu < 0)
+    return;
+
+  if (huge)
+  { /* Frames and pages of a huge page are aligned on its size */
+    span = mm_huge_pgn;
+    pgn &= ~(span - 1);
+    fpn &= ~(span - 1);
+  }
+
+  pthread_once(&tlb_once, tlb_init);
+  t = &tlb[cpu];
+
+  pthread_mutex_lock(&t->lock);
+  te = tlb_slot(t, mm, pgn);
+  tlb_drop(t, te);
+  te->mm = mm;
+  te->pgn = pgn;
+  te->fpn = fpn;
+  te->writable = writable;
+  te->span = span;
+  t->reach += span;
+  peak = __atomic_load_n(&tlb_peak_reach, __ATOMIC_RELAXED);
+  while (t->reach > peak &&
+         !__atomic_compare_exchange_n(&tlb_peak_reach, &peak, t->reach, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ *  tlb_invalidate - shoot down a page translation on every CPU
+ *  @mm: address space
+ *  @pgn: page leaving its frame
+ */
+void tlb_invalidate(struct mm_struct *mm, int pgn)
+{
+  struct tlb_entry *te;
+  int cpu;
+
+  pthread_once(&tlb_once, tlb_init);
+  for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+  {
+    pthread_mutex_lock(&tlb[cpu].lock);
+    te = tlb_slot(&tlb[cpu], mm, pgn);
+    if (te->mm == mm && te->pgn == pgn)
+      tlb_drop(&tlb[cpu], te);
+    if ((te = tlb_huge_slot(&tlb[cpu], mm, pgn)) != NULL)
+      tlb_drop(&tlb[cpu], te);
+    pthread_mutex_unlock(&tlb[cpu].lock);
+  }
+}
+
+/*
+ *  tlb_flush_mm - drop every translation of an address space
+ *  @mm: address space going away
+ */
+void tlb_flush_mm(struct mm_struct *mm)
+{
+  int cpu, i;
+
+  pthread_once(&tlb_once, tlb_init);
+  for (cpu = 0; cpu < MEMPHY_MAX_CPU; cpu++)
+  {
+    pthread_mutex_lock(&tlb[cpu].lock);
+    for (i = 0; i < TLB_NR_ENTRY; i++)
+      if (tlb[cpu].ent[i].mm == mm)
+        tlb_drop(&tlb[cpu], &tlb[cpu].ent[i]);
+    pthread_mutex_unlock(&tlb[cpu].lock);
+  }
+}
+
+/*
+ *  tlb_huge_stat - get the huge page statistics of the TLBs
+ *  @hit: hits through a huge page entry
+ *  @reach: peak pages mapped by the TLB of one CPU
+ */
+void tlb_huge_stat(long *hit, int *reach)
+{
+  *hit = __atomic_load_n(&tlb_nr_huge_hit, __ATOMIC_RELAXED);
+  *reach = __atomic_load_n(&tlb_peak_reach, __ATOMIC_RELAXED);
+}
+#endif
@@ -10,24 +10,34 @@
 #include <stdio.h>
 #include <pthread.h>
 
+/* Time slots a memory access waits after its fault found no frame */
+#define PG_FAULT_RETRY 16
+
+int mm_repl_global = 1;
+int mm_lazy_alloc = 0;
+int mm_ra_max = 0;
+int mm_sbrk_max = 0; /* a page or less grows the break exactly */
+
+/* Readahead statistics, updated from every CPU */
+static long ra_nr_read, ra_nr_hit, ra_nr_miss;
+
+/* Break growth statistics, updated from every CPU */
+static long sbrk_nr_grow, sbrk_nr_saved, sbrk_rsv_bytes;
+
 /*enlist_vm_freerg_list - add new rg to freerg_list
  *@mm: memory region
- *@rg_elmt: new region
+ *@rg_elmt: new region, returns the free range it was merged into
  *
+ * The free space of the VMA keeps its own node, merged with the free
+ * ranges around it
  */
-int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt) {
-  struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
+int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt) {
+  struct vm_area_struct *vma = get_vma_by_num(mm, rg_elmt->vmaid);
 
-  if (rg_elmt.rg_start >= rg_elmt.rg_end)
+  if (vma == NULL || vma->vm_shm != NULL)
     return -1;
 
-  if (rg_node != NULL)
-    rg_elmt.rg_next = rg_node;
-
-  /* Enlist the new region */
-  mm->mmap->vm_freerg_list = &rg_elmt;
-
-  return 0;
+  return freerg_insert(vma, rg_elmt->rg_start, rg_elmt->rg_end, rg_elmt);
 }
 
 /*get_vma_by_num - get vm area by numID
@@ -37,23 +47,40 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt) {
  */
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
 {
-  struct vm_area_struct *pvma= mm->mmap;
-
-  if(mm->mmap == NULL) 
+  if (vmaid < 0 || vmaid >= mm->vmatbl_sz)
     return NULL;
 
-  int vmait = 0;
-  
-  while (vmait < vmaid)
-  {
-    if(pvma == NULL)
-	  return NULL;
+  return mm->vmatbl[vmaid];
+}
+
+/*set_vma_by_num - index a vm area by its numID
+ *@mm: memory region
+ *@vmaid: ID of the vm area
+ *@vma: vm area, NULL once it left the mmap list
+ *
+ */
+int set_vma_by_num(struct mm_struct *mm, int vmaid, struct vm_area_struct *vma)
+{
+  struct vm_area_struct **tbl;
+  int sz = (mm->vmatbl_sz > 0) ? mm->vmatbl_sz : 4;
 
-    vmait++;
-    pvma = pvma->vm_next;
+  if (vmaid < 0)
+    return -1;
+
+  if (vmaid >= mm->vmatbl_sz)
+  {
+    while (sz <= vmaid)
+      sz *= 2;
+    tbl = realloc(mm->vmatbl, sz * sizeof(struct vm_area_struct *));
+    if (tbl == NULL)
+      return -1;
+    memset(&tbl[mm->vmatbl_sz], 0, (sz - mm->vmatbl_sz) * sizeof(struct vm_area_struct *));
+    mm->vmatbl = tbl;
+    mm->vmatbl_sz = sz;
   }
 
-  return pvma;
+  mm->vmatbl[vmaid] = vma;
+  return 0;
 }
 
 /*get_symrg_byid - get mem region by region ID
@@ -63,12 +90,182 @@ struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
  */
 struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
 {
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if(rgid < 0 || rgid >= mm->symrgtbl_sz)
+    return NULL;
+
+  return &mm->symrgtbl[rgid];
+}
+
+/*alloc_symrg_byid - get mem region by region ID, growing the table
+ *@mm: memory region
+ *@rgid: region ID about to be bound to a region
+ *
+ * The table doubles until it holds rgid, new entries are empty regions
+ */
+struct vm_rg_struct *alloc_symrg_byid(struct mm_struct *mm, int rgid)
+{
+  struct vm_rg_struct *tbl;
+  int sz = (mm->symrgtbl_sz > 0) ? mm->symrgtbl_sz : PAGING_SYMTBL_INIT_SZ;
+
+  if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
     return NULL;
 
+  if (rgid >= mm->symrgtbl_sz)
+  {
+    while (sz <= rgid)
+      sz *= 2;
+    if (sz > PAGING_MAX_SYMTBL_SZ)
+      sz = PAGING_MAX_SYMTBL_SZ;
+    tbl = realloc(mm->symrgtbl, sz * sizeof(struct vm_rg_struct));
+    if (tbl == NULL)
+      return NULL;
+    memset(&tbl[mm->symrgtbl_sz], 0, (sz - mm->symrgtbl_sz) * sizeof(struct vm_rg_struct));
+    mm->symrgtbl = tbl;
+    mm->symrgtbl_sz = sz;
+  }
+
   return &mm->symrgtbl[rgid];
 }
 
+/*pg_unmap_page - drop a page from the page table and release its backing
+ *@caller: caller, its mm is locked
+ *@pgn: page number
+ *
+ * A frame or swap slot shared after fork stays with its other mappers,
+ * a huge page is split so that only this page of it goes.
+ * Return 1 if the page was mapped
+ */
+int pg_unmap_page(struct pcb_t *caller, int pgn)
+{
+  struct framephy_struct *fp;
+  pte_t pte = caller->mm->pgd[pgn];
+
+  if (!PAGING_PTE_PAGE_PRESENT(pte))
+    return 0;
+
+  if (!(pte & PAGING_PTE_SWAPPED_MASK))
+  {
+    if (pte & PAGING_PTE_HUGE_MASK)
+      huge_split(caller->mram, caller->mm, pgn);
+    fp = &caller->mram->frmtbl[PAGING_PTE_FPN(pte)];
+    if (MEMPHY_unshare_usedfp(caller->mram, fp->fpn, caller->mm, pgn) == 0)
+    {
+      if (fp->swpoff >= 0)
+      {
+        swap_put_slot(fp->swptyp, fp->swpoff);
+        fp->swpoff = -1;
+      }
+      MEMPHY_put_freefp(caller->mram, fp->fpn);
+    }
+  }
+  else
+    swap_put_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+
+  caller->mm->pgd[pgn] = 0;
+  return 1;
+}
+
+/*pg_release_range - give back the pages of a free range
+ *@caller: caller, its mm is locked
+ *@vma: memory area of the range
+ *@rg: free range, after merging with its free neighbours
+ *
+ * Only pages the range covers entirely are unmapped, a page still
+ * holding part of an allocated region keeps its frame. A free range
+ * reaching the break moves the break down to its first free page.
+ * Return the number of pages unmapped
+ */
+static int pg_release_range(struct pcb_t *caller, struct vm_area_struct *vma,
+                            struct vm_rg_struct *rg)
+{
+  unsigned long top = PAGING_PAGE_ALIGNSZ(rg->rg_start);
+  int pgn, nr = 0;
+
+  for (pgn = PAGING_PGN(top); pgn < (int)(rg->rg_end / PAGING_PAGESZ); pgn++)
+    if (pg_unmap_page(caller, pgn))
+    {
+      tlb_invalidate(caller->mm, pgn);
+      nr++;
+    }
+
+  if (rg->rg_end == vma->sbrk && top < vma->sbrk &&
+      freerg_remove(vma, top, vma->sbrk) == 0)
+  {
+    vma->sbrk = vma->vm_end = top;
+    if (vma->vm_used > top)
+      vma->vm_used = top;
+    /* The heap shrinks, reserve less the next time it grows */
+    if (vma->vm_grow / 2 >= PAGING_SBRK_INIT_SZ)
+      vma->vm_grow /= 2;
+  }
+
+  return nr;
+}
+
+/*pg_map_range - map the missing pages of a region in eager mode
+ *@caller: caller, its mm is locked
+ *@rg: region reusing free space whose pages were given back
+ *
+ */
+static int pg_map_range(struct pcb_t *caller, struct vm_rg_struct *rg)
+{
+  struct vm_rg_struct maprg;
+  int pgn, run, pgend = PAGING_PGN((rg->rg_end - 1));
+
+  for (pgn = PAGING_PGN(rg->rg_start); pgn <= pgend; pgn += run)
+  {
+    for (run = 0; pgn + run <= pgend && !PAGING_PTE_PAGE_PRESENT(caller->mm->pgd[pgn + run]); run++)
+      ;
+    if (run == 0)
+    {
+      run = 1;
+      continue;
+    }
+    if (vm_map_ram(caller, pgn * PAGING_PAGESZ, (pgn + run) * PAGING_PAGESZ,
+                   pgn * PAGING_PAGESZ, run, &maprg) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*mm_rss - count the pages of a process resident in MEMRAM
+ *@mm: memory region, locked by the caller
+ *
+ */
+int mm_rss(struct mm_struct *mm)
+{
+  struct vm_area_struct *vma;
+  pte_t pte;
+  int pgn, nr = 0;
+
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    for (pgn = PAGING_PGN(vma->vm_start); pgn < (int)(vma->vm_end / PAGING_PAGESZ); pgn++)
+    {
+      pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+      if (PAGING_PTE_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_SWAPPED_MASK))
+        nr++;
+    }
+
+  return nr;
+}
+
+/*sbrk_account_alloc - count an allocation against exact break growth
+ *@vma: memory area
+ *@rg: region just allocated
+ *
+ * Without reservation the break stays page aligned right above the
+ * highest region, going past it would have been one more growth
+ */
+static void sbrk_account_alloc(struct vm_area_struct *vma, struct vm_rg_struct *rg, int grown)
+{
+  if (!grown && rg->rg_end > PAGING_PAGE_ALIGNSZ(vma->vm_used))
+    __atomic_fetch_add(&sbrk_nr_saved, 1, __ATOMIC_RELAXED);
+
+  if (rg->rg_end > vma->vm_used)
+    vma->vm_used = rg->rg_end;
+}
+
 /*__alloc - allocate a region memory
  *@caller: caller
  *@vmaid: ID vm area to alloc memory region
@@ -79,17 +276,26 @@ struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
  */
 int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size,
             int *alloc_addr) {
-  if (size <= 0)
+  struct vm_rg_struct *sym_rg = alloc_symrg_byid(caller->mm, rgid);
+
+  if (size <= 0 || sym_rg == NULL)
     return -1;
   /*Khởi tạo một cấu trúc vùng nhớ*/
   struct vm_rg_struct rgnode;
   rgnode.vmaid = vmaid; /* TODO: commit the vmaid */
                         /* get_free_vmrg_area SUCCESS */
   if (get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0) {         // Tìm không gian vùng nhớ trống có kích thước size
-    caller->mm->symrgtbl[rgid].rg_start = rgnode.rg_start;
-    caller->mm->symrgtbl[rgid].rg_end = rgnode.rg_end;
+    /* Pages of reused free space may have been given back */
+    if (!mm_lazy_alloc && pg_map_range(caller, &rgnode) < 0) {
+      enlist_vm_freerg_list(caller->mm, &rgnode);
+      return -1;
+    }
+    sbrk_account_alloc(get_vma_by_num(caller->mm, vmaid), &rgnode, 0);
+
+    sym_rg->rg_start = rgnode.rg_start;
+    sym_rg->rg_end = rgnode.rg_end;
 
-    caller->mm->symrgtbl[rgid].vmaid = rgnode.vmaid;
+    sym_rg->vmaid = rgnode.vmaid;
 
     *alloc_addr = rgnode.rg_start;
 
@@ -102,7 +308,8 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size,
    * redundant warning*/
   /*Attempt to increate limit to get space */
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid); // Lấy vùng nhớ hiện tại
-  int inc_sz = PAGING_PAGE_ALIGNSZ(size);                             // Tính kích thước cần mở rộng thê,
+  /* Free space ending at the break only needs the missing part */
+  int inc_sz = PAGING_PAGE_ALIGNSZ(size - freerg_tail(cur_vma));
   int inc_limit_ret;                                                  // Lưu trữ kết quả tăng giưới hạn
 
   /* TODO retrive old_sbrk if needed, current comment out due to compiler
@@ -120,19 +327,23 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size,
   /*SUCCESSFUL increase limit */
 
   /* TODO: commit the limit increment */
-  unsigned long new_sbrk = old_sbrk + size;
-  if (new_sbrk < cur_vma->vm_end) {
-    struct vm_rg_struct *new_free_rg =
-      init_vm_rg(new_sbrk, cur_vma->vm_end, vmaid);                 // init_vm_rg : cấp phát mọt vùng nhớ trống (mm.c)
-      enlist_vm_freerg_list(caller->mm, *new_free_rg);              // enlist_vm_freerg_list: add new rg to freerg_list
+  freerg_insert(cur_vma, old_sbrk, cur_vma->sbrk, NULL);
+  if (get_free_vmrg_area(caller, vmaid, size, &rgnode) < 0)
+    return -1;
+  /* Part of the region may lie in the unmapped rest of a reservation */
+  if (!mm_lazy_alloc && pg_map_range(caller, &rgnode) < 0) {
+    enlist_vm_freerg_list(caller->mm, &rgnode);
+    return -1;
   }
+  sbrk_account_alloc(cur_vma, &rgnode, 1);
+
   /* TODO: commit the allocation address
   // *alloc_addr = ...
  */
-  caller->mm->symrgtbl[rgid].rg_start = old_sbrk;
-  caller->mm->symrgtbl[rgid].rg_end = new_sbrk;
-  caller->mm->symrgtbl[rgid].vmaid = vmaid;
-  *alloc_addr = old_sbrk;
+  sym_rg->rg_start = rgnode.rg_start;
+  sym_rg->rg_end = rgnode.rg_end;
+  sym_rg->vmaid = vmaid;
+  *alloc_addr = rgnode.rg_start;
 
   return 0;
 }
@@ -143,6 +354,7 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size,
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size 
  *
+ * Return the number of pages given back, -1 on error
  */
 int __free(struct pcb_t *caller, int rgid) {
   struct vm_rg_struct rgnode;
@@ -153,7 +365,7 @@ int __free(struct pcb_t *caller, int rgid) {
   // rgnode.vmaid = 0; // dummy initialization
   // rgnode.vmaid = 1; // dummy initialization
   /*Kiểm tra tính hợp lệ của đầu vào*/
-  if (rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ) {
+  if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ) {
     printf("ERROR: invalid region ID.\n");
     return -1;
   }
@@ -163,20 +375,26 @@ int __free(struct pcb_t *caller, int rgid) {
   }
   /* TODO: Manage the collect freed region to freerg_list */
   // Đảm bảo region tồn tại để remove
-  struct vm_rg_struct *sym_rg = &(caller->mm->symrgtbl[rgid]);
-  if (!sym_rg) {
+  struct vm_rg_struct *sym_rg = get_symrg_byid(caller->mm, rgid);
+  if (!sym_rg || sym_rg->rg_start >= sym_rg->rg_end) {
     printf("ERROR: Region ID %d is not allocated.\n", rgid);
     return -1;
   }
   rgnode.rg_start = sym_rg->rg_start;
   rgnode.rg_end = sym_rg->rg_end;
+  rgnode.vmaid = sym_rg->vmaid;
 
   /*enlist the obsoleted memory region */
-  if (enlist_vm_freerg_list(caller->mm, rgnode) < 0) {
+  if (enlist_vm_freerg_list(caller->mm, &rgnode) < 0) {
     printf("ERROR: Failed to enlist the free region.\n ");
     return -1;
   }
-  return 0;
+
+  /* The space may be handed out again, a second free must not see it */
+  sym_rg->rg_start = sym_rg->rg_end = 0;
+
+  /* Pages now entirely free go back to MEMPHY and the swap devices */
+  return pg_release_range(caller, get_vma_by_num(caller->mm, rgnode.vmaid), &rgnode);
 }
 
 /*pgalloc - PAGING-based allocate a region memory
@@ -186,10 +404,14 @@ int __free(struct pcb_t *caller, int rgid) {
  */
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
-  int addr;
+  int addr, ret;
 
   /* By default using vmaid = 0 */
-  return __alloc(proc, 0, reg_index, size, &addr);
+  pthread_mutex_lock(&proc->mm->lock);
+  ret = __alloc(proc, 0, reg_index, size, &addr);
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return ret;
 }
 
 /*pgmalloc - PAGING-based allocate a region memory
@@ -199,10 +421,14 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
  */
 int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
-  int addr;
+  int addr, ret;
 
   /* By default using vmaid = 1 */
-  return __alloc(proc, 1, reg_index, size, &addr);
+  pthread_mutex_lock(&proc->mm->lock);
+  ret = __alloc(proc, 1, reg_index, size, &addr);
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return ret;
 }
 
 /*pgfree - PAGING-based free a region memory
@@ -213,7 +439,520 @@ int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
 {
-   return __free(proc, reg_index);
+   int ret;
+
+   pthread_mutex_lock(&proc->mm->lock);
+#ifdef VMDBG
+   int rss = mm_rss(proc->mm);
+#endif
+   ret = __free(proc, reg_index);
+#ifdef VMDBG
+   if (ret >= 0)
+     printf("free region=%d pages released=%d rss=%d->%d pages\n",
+            reg_index, ret, rss, mm_rss(proc->mm));
+#endif
+   pthread_mutex_unlock(&proc->mm->lock);
+
+   return (ret < 0) ? ret : 0;
+}
+
+/*pg_unlock_victim - unlock the mappers of a victim frame
+ *@vfp: victim frame, unlinked from the used lists
+ *@vicmm: owner of the victim
+ *@mm: faulting mm, stays locked
+ *
+ */
+static void pg_unlock_victim(struct framephy_struct *vfp, struct mm_struct *vicmm,
+                             struct mm_struct *mm)
+{
+  struct frame_map *map;
+
+  if (vicmm != mm)
+    pthread_mutex_unlock(&vicmm->lock);
+  for (map = vfp->maps; map != NULL; map = map->next)
+    if (map->mm != mm)
+      pthread_mutex_unlock(&map->mm->lock);
+}
+
+/*__pg_evict_frame - swap out a victim page and take its frame
+ *@mram: MEMRAM
+ *@mm: faulting mm, already locked, NULL for background reclaim
+ *@own: only pick among the pages of mm
+ *@retfpn: return FPN of the victim frame, no longer mapped
+ *
+ * Background reclaim has no faulting process, it always picks the
+ * victim system wide.
+ */
+static int __pg_evict_frame(struct memphy_struct *mram, struct mm_struct *mm, int own,
+                            int *retfpn)
+{
+  struct mm_struct *vicmm = mm;
+  struct framephy_struct *vfp;
+  struct frame_map *map;
+  int vicpgn, vicfpn, swptyp, swpoff, dirty;
+
+  if (own)
+  {
+    if (find_victim_page(mram, mm, &vicpgn, &vicfpn) < 0)
+      return -1;
+  }
+  else if (mm_repl_global || mm == NULL)
+  {
+    /* Pick the victim system wide, its mappers come back locked */
+    if (find_victim_frame(mram, mm, &vicmm, &vicpgn, &vicfpn) < 0)
+      return -1;
+  }
+  /* RAM has no free frame, evict one of our own pages */
+  else if (find_victim_page(mram, mm, &vicpgn, &vicfpn) < 0)
+  {
+    /* None resident (allocated in swap while RAM was full), a frame
+     * has to come from another process */
+    if (find_victim_frame(mram, mm, &vicmm, &vicpgn, &vicfpn) < 0)
+      return -1;
+  }
+
+  /* A page read ahead for nothing shrinks the window of its owner */
+  vfp = &mram->frmtbl[vicfpn];
+  if (vfp->ra)
+  {
+    vfp->ra = 0;
+    vicmm->ra_win /= 2;
+    __atomic_fetch_add(&ra_nr_miss, 1, __ATOMIC_RELAXED);
+  }
+
+  /* A frame shared after fork is dirty if any mapper wrote it before */
+  dirty = (vicmm->pgd[vicpgn] & PAGING_PTE_DIRTY_MASK) != 0;
+  for (map = vfp->maps; map != NULL; map = map->next)
+    if (map->mm->pgd[map->pgn] & PAGING_PTE_DIRTY_MASK)
+      dirty = 1;
+
+  if (!dirty && vfp->swpoff >= 0)
+  {
+    /* Clean page, the copy in its swap slot is still up to date */
+    swptyp = vfp->swptyp;
+    swpoff = vfp->swpoff;
+    swap_account_pageout(0);
+  }
+  else
+  {
+    if (vfp->swpoff >= 0 && !swap_slot_shared(vfp->swptyp, vfp->swpoff))
+    { /* Dirty page, rewrite its old slot in place */
+      swptyp = vfp->swptyp;
+      swpoff = vfp->swpoff;
+      zswap_invalidate(swptyp, swpoff);
+    }
+    else if (swap_get_slot(&swptyp, &swpoff) < 0)
+    { /* Get a slot on one of the swap devices */
+      MEMPHY_put_usedfp(mram, vicfpn, vicmm, vicpgn);
+      pg_unlock_victim(vfp, vicmm, mm);
+      return -1;
+    }
+    else if (vfp->swpoff >= 0)
+    { /* Old slot is still mapped by swapped pages of other processes */
+      swap_put_slot(vfp->swptyp, vfp->swpoff);
+    }
+
+    /* Copy victim frame to swap, the compressed pool goes first */
+    if (zswap_store(mram, vicfpn, swptyp, swpoff) < 0)
+      __swap_cp_page(mram, vicfpn, swap_dev(swptyp), swpoff);
+    swap_account_pageout(1);
+  }
+  vfp->swpoff = -1;
+
+  /* Fix up the owner PTE, it may belong to another process */
+  pte_set_swap(&vicmm->pgd[vicpgn], swptyp, swpoff);
+  tlb_invalidate(vicmm, vicpgn);
+
+  /* Every other mapper refers to the slot as well */
+  for (map = vfp->maps; map != NULL; map = map->next)
+  {
+    swap_dup_slot(swptyp, swpoff);
+    pte_set_swap(&map->mm->pgd[map->pgn], swptyp, swpoff);
+    tlb_invalidate(map->mm, map->pgn);
+  }
+  pg_unlock_victim(vfp, vicmm, mm);
+
+  /* Pages of a merged frame share its swap slot from now on */
+  MEMPHY_ksm_drop(mram, vfp);
+  while ((map = vfp->maps) != NULL)
+  {
+    vfp->maps = map->next;
+    free(map);
+  }
+  vfp->mapcount = 0;
+
+  *retfpn = vicfpn;
+  return 0;
+}
+
+/*pg_evict_frame - swap out a victim page and take its frame
+ *@mram: MEMRAM
+ *@mm: faulting mm, already locked, NULL for background reclaim
+ *@retfpn: return FPN of the victim frame, no longer mapped
+ *
+ */
+int pg_evict_frame(struct memphy_struct *mram, struct mm_struct *mm, int *retfpn)
+{
+  return __pg_evict_frame(mram, mm, 0, retfpn);
+}
+
+/*pg_evict_own_frame - swap out a page of mm to reuse its frame
+ *@mram: MEMRAM
+ *@mm: mm over a resident limit, already locked
+ *@retfpn: return FPN of the victim frame, no longer mapped
+ *
+ * Fails if mm has no page in MEMRAM, the frame never comes from
+ * another process.
+ */
+int pg_evict_own_frame(struct memphy_struct *mram, struct mm_struct *mm, int *retfpn)
+{
+  if (__pg_evict_frame(mram, mm, 1, retfpn) < 0)
+    return -1;
+
+  memcg_account_evict(mm);
+  return 0;
+}
+
+/*pg_swapout_mm - swap out pages of a suspended mm and free their frames
+ *@mram: MEMRAM
+ *@mm: mm of a process off the CPUs, already locked
+ *@nr: most frames freed
+ *
+ * Return the number of frames freed, fewer once mm has no page left
+ * in MEMRAM or its pages cannot be evicted now.
+ */
+int pg_swapout_mm(struct memphy_struct *mram, struct mm_struct *mm, int nr)
+{
+  int fpn, i;
+
+  for (i = 0; i < nr; i++)
+  {
+    if (__pg_evict_frame(mram, mm, 1, &fpn) < 0)
+      break;
+    MEMPHY_put_freefp(mram, fpn);
+  }
+
+  return i;
+}
+
+/*pg_getframe - get a free frame in ram, swap out a victim page if ram is full
+ *@mm: memory region
+ *@retfpn: return FPN
+ *@caller: caller
+ *
+ */
+static int pg_getframe(struct mm_struct *mm, int *retfpn, struct pcb_t *caller)
+{
+  /* At a resident limit the page takes the place of one of ours */
+  if (memcg_room(mm) <= 0 && pg_evict_own_frame(caller->mram, mm, retfpn) == 0)
+    return 0;
+
+  if (MEMPHY_get_freefp(caller->mram, retfpn) == 0)
+    return 0;
+
+  /* Background reclaim did not keep up, evict in the fault path */
+  kswapd_account_direct();
+
+  return pg_evict_frame(caller->mram, mm, retfpn);
+}
+
+/*pg_getzeroframe - get a frame filled with zeroes for a new page
+ *@mm: memory region
+ *@retfpn: return FPN
+ *@caller: caller
+ *
+ * A frame cleared ahead by the zeroing worker saves clearing one here.
+ */
+static int pg_getzeroframe(struct mm_struct *mm, int *retfpn, struct pcb_t *caller)
+{
+  if (memcg_room(mm) > 0 && zero_getfp(caller->mram, retfpn) == 0)
+    return 0;
+
+  if (pg_getframe(mm, retfpn, caller) < 0)
+    return -1;
+
+  zero_frame(caller->mram, *retfpn);
+  return 0;
+}
+
+/*pg_swapin - copy a swapped page into a frame
+ *@mram: MEMRAM
+ *@fpn: destination frame, not mapped yet
+ *@swptyp, @swpoff: swap slot of the page
+ *
+ * The slot keeps a valid copy until the page is written, a clean
+ * eviction needs no write back.
+ */
+static void pg_swapin(struct memphy_struct *mram, int fpn, int swptyp, int swpoff)
+{
+  /* The compressed pool goes first */
+  if (zswap_load(mram, fpn, swptyp, swpoff) < 0)
+    __swap_cp_page(swap_dev(swptyp), swpoff, mram, fpn);
+  mram->frmtbl[fpn].swptyp = swptyp;
+  mram->frmtbl[fpn].swpoff = swpoff;
+}
+
+/*pg_advise_swapin - hint file backed swap devices at slots read next
+ *@mm: memory region
+ *@start: first page
+ *@end: page after the last one
+ *
+ * Runs of consecutive slots on one device go in a single hint.
+ */
+static void pg_advise_swapin(struct mm_struct *mm, int start, int end)
+{
+  int pg, typ = -1, base = 0, nr = 0;
+  pte_t pte;
+
+  for (pg = start; pg < end; pg++)
+  {
+    pte = __atomic_load_n(&mm->pgd[pg], __ATOMIC_RELAXED);
+    if (!PAGING_PTE_PAGE_PRESENT(pte) || !(pte & PAGING_PTE_SWAPPED_MASK) ||
+        (pte & PAGING_PTE_SHM_MASK))
+      continue;
+
+    if (nr > 0 && (int)PAGING_PTE_SWPTYP(pte) == typ && (int)PAGING_PTE_SWP(pte) == base + nr)
+    {
+      nr++;
+      continue;
+    }
+    if (nr > 0)
+      MEMPHY_advise_frames(swap_dev(typ), base, nr);
+    typ = PAGING_PTE_SWPTYP(pte);
+    base = PAGING_PTE_SWP(pte);
+    nr = 1;
+  }
+
+  if (nr > 0)
+    MEMPHY_advise_frames(swap_dev(typ), base, nr);
+}
+
+/*pg_readahead - swap in the pages following a sequential fault
+ *@mm: memory region
+ *@pgn: faulting page, its frame is not in the used lists yet
+ *@caller: caller
+ *
+ * The window doubles while faults keep hitting the page right after
+ * the last window and stops at the end of the region being accessed.
+ * Pages come in referenced once, so they survive one replacement pass
+ * and an unused readahead goes on the next one.
+ */
+static void pg_readahead(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+  int maxwin = caller->mram->maxsz / PAGING_PAGESZ / 2;
+  int vmend = -1, pg, fpn, nr = 0;
+  struct vm_area_struct *vma;
+  pte_t pte;
+
+  if (mm_ra_max <= 0)
+    return;
+
+  if (pgn != mm->ra_next)
+  { /* Random access, only remember where a sequence would go on */
+    mm->ra_win = 0;
+    mm->ra_next = pgn + 1;
+    return;
+  }
+
+  mm->ra_win = (mm->ra_win > 0) ? mm->ra_win * 2 : 2;
+  if (mm->ra_win > mm_ra_max)
+    mm->ra_win = mm_ra_max;
+  if (mm->ra_win > maxwin)
+    mm->ra_win = maxwin;
+
+  /* Stay inside the area the faulting page belongs to, pages of freed
+   * regions are unmapped and skipped */
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    if (PAGING_PGN(vma->vm_start) <= pgn && pgn < (int)(vma->vm_end / PAGING_PAGESZ))
+    {
+      vmend = vma->vm_end / PAGING_PAGESZ - 1;
+      break;
+    }
+
+  /* The window is copied in one page at a time, let the swap files
+   * fetch all of it first */
+  pg_advise_swapin(mm, pgn + 1, ((pgn + mm->ra_win < vmend) ? pgn + mm->ra_win : vmend) + 1);
+
+  for (pg = pgn + 1; pg <= pgn + mm->ra_win && pg <= vmend; pg++)
+  {
+    pte = __atomic_load_n(&mm->pgd[pg], __ATOMIC_RELAXED);
+    if (!PAGING_PTE_PAGE_PRESENT(pte) || !(pte & PAGING_PTE_SWAPPED_MASK) ||
+        (pte & PAGING_PTE_SHM_MASK))
+      continue;
+
+    /* Reading ahead must not push out pages of a process at its limit */
+    if (memcg_room(mm) <= 0 || pg_getframe(mm, &fpn, caller) < 0)
+      break;
+
+    pg_swapin(caller->mram, fpn, PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+    pte_set_fpn(&mm->pgd[pg], fpn);
+    MEMPHY_put_usedfp(caller->mram, fpn, mm, pg);
+    caller->mram->frmtbl[fpn].ra = 1;
+    pte_set_ref(&mm->pgd[pg]);
+    nr++;
+  }
+
+  mm->ra_next = pg;
+  __atomic_fetch_add(&ra_nr_read, nr, __ATOMIC_RELAXED);
+}
+
+/*pg_cow_break - give a page of its own to the writer of a shared frame
+ *@mm: memory region
+ *@pgn: page written
+ *@fpn: FPN of the shared frame, return the private FPN
+ *@caller: caller
+ *
+ */
+static int pg_cow_break(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+  BYTE page[PAGING_PAGESZ];
+  int srcfpn = *fpn, tgtfpn, i;
+  pte_t pte;
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+    MEMPHY_read(caller->mram, srcfpn * PAGING_PAGESZ + i, &page[i]);
+
+  if (caller->mram->frmtbl[srcfpn].ksm)
+    ksm_account_unmerge();
+
+  /* Only a mapper adds mappers and the others are gone, nobody can
+   * share the frame again while we hold our lock */
+  if (__atomic_load_n(&caller->mram->frmtbl[srcfpn].mapcount, __ATOMIC_RELAXED) == 1)
+  { /* The frame is ours already */
+    CLRBIT(mm->pgd[pgn], PAGING_PTE_COW_MASK);
+    return 0;
+  }
+
+  /* Stay a mapper while getting the frame, an eviction of the shared
+   * one then fixes up our PTE along with the others */
+  if (pg_getframe(mm, &tgtfpn, caller) < 0)
+    return -1;
+
+  pte = mm->pgd[pgn];
+  if (!PAGING_PTE_PAGE_PRESENT(pte) || (pte & PAGING_PTE_SWAPPED_MASK) ||
+      PAGING_PTE_FPN(pte) != srcfpn)
+  { /* Evicted meanwhile, the slot keeps the copy of the others */
+    swap_put_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+  }
+  else if (MEMPHY_unshare_usedfp(caller->mram, srcfpn, mm, pgn) == 0)
+  { /* Every other mapper went away meanwhile, the frame is ours */
+    MEMPHY_put_freefp(caller->mram, tgtfpn);
+    CLRBIT(mm->pgd[pgn], PAGING_PTE_COW_MASK);
+    MEMPHY_put_usedfp(caller->mram, srcfpn, mm, pgn);
+    return 0;
+  }
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+    MEMPHY_write(caller->mram, tgtfpn * PAGING_PAGESZ + i, page[i]);
+
+  /* Another CPU may still translate the page to the shared frame,
+   * which the remaining mapper now writes in place */
+  tlb_invalidate(mm, pgn);
+  pte_set_fpn(&mm->pgd[pgn], tgtfpn);
+  CLRBIT(mm->pgd[pgn], PAGING_PTE_COW_MASK);
+  MEMPHY_put_usedfp(caller->mram, tgtfpn, mm, pgn);
+  pte_set_ref(&mm->pgd[pgn]);
+  mm->cowfault++;
+
+  *fpn = tgtfpn;
+  return 0;
+}
+
+/*pg_shm_getpage - map the frame of a shared memory page
+ *@mm: memory region
+ *@pgn: page of a segment attached to mm
+ *@fpn: return FPN
+ *@caller: caller
+ *
+ * The anchor of the segment tells where the page lives, an attacher
+ * never brings a page in for itself only.
+ */
+static int pg_shm_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+  pte_t pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+  struct vm_area_struct *vma = shm_find_vma(mm, pgn * PAGING_PAGESZ);
+  struct shm_segment *seg;
+  pte_t spte;
+  int idx, tgtfpn, resident, fresh, ret;
+
+  if (vma == NULL)
+    return -1;
+
+  seg = vma->vm_shm;
+  idx = pgn - PAGING_PGN(vma->vm_start);
+
+  /* Our swap reference was taken when the frame got evicted */
+  if (pte & PAGING_PTE_SWAPPED_MASK)
+    swap_put_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+  mm->pgd[pgn] = PAGING_PTE_SHM_MASK;
+
+  /* Evictions of the segment frames are held off meanwhile */
+  pthread_mutex_lock(&seg->mm.lock);
+  spte = __atomic_load_n(&seg->mm.pgd[idx], __ATOMIC_RELAXED);
+  resident = PAGING_PTE_PAGE_PRESENT(spte) && !(spte & PAGING_PTE_SWAPPED_MASK);
+
+  if (resident)
+    tgtfpn = PAGING_PTE_FPN(spte);
+  else
+  {
+    /* First touch of the page by any attacher, it reads as zeroes */
+    fresh = !PAGING_PTE_PAGE_PRESENT(spte);
+    ret = fresh ? pg_getzeroframe(mm, &tgtfpn, caller) : pg_getframe(mm, &tgtfpn, caller);
+
+    /* Local scope charges segment pages to the segment, it can give
+     * back one of its own frames when the attacher has none to spare */
+    if (ret < 0 && !mm_repl_global && pg_getframe(&seg->mm, &tgtfpn, caller) == 0)
+    {
+      ret = 0;
+      if (fresh)
+        zero_frame(caller->mram, tgtfpn);
+    }
+    if (ret < 0)
+    {
+      pthread_mutex_unlock(&seg->mm.lock);
+      return -1;
+    }
+
+    if (fresh)
+      mm->pgzero++;
+    else
+      pg_swapin(caller->mram, tgtfpn, PAGING_PTE_SWPTYP(spte), PAGING_PTE_SWP(spte));
+
+    pte_set_fpn(&seg->mm.pgd[idx], tgtfpn);
+    MEMPHY_put_usedfp(caller->mram, tgtfpn, &seg->mm, idx);
+  }
+
+  pte_set_fpn(&mm->pgd[pgn], tgtfpn);
+  MEMPHY_share_usedfp(caller->mram, tgtfpn, mm, pgn);
+  pthread_mutex_unlock(&seg->mm.lock);
+  shm_account_fault(resident);
+
+  *fpn = tgtfpn;
+  pte_set_ref(&mm->pgd[pgn]);
+  return 0;
+}
+
+/*pg_lazy_page - tell whether an unmapped page is one to zero-fill
+ *@mm: memory region
+ *@pgn: page not mapped yet
+ *
+ * Only lazy allocation leaves pages unmapped inside a VMA below its
+ * break. Any other unmapped page lies past the break, in a freed
+ * region or outside every VMA.
+ */
+static int pg_lazy_page(struct mm_struct *mm, int pgn)
+{
+  unsigned long addr = (unsigned long)pgn * PAGING_PAGESZ;
+  struct vm_area_struct *vma;
+
+  if (!mm_lazy_alloc)
+    return 0;
+
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    if (vma->vm_start <= addr && addr < vma->sbrk)
+      return 1;
+
+  return 0;
 }
 
 /*pg_getpage - get the page in ram
@@ -225,57 +964,64 @@ int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
  */
 int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
 {
-  uint32_t pte = mm->pgd[pgn];
-  if (!PAGING_PTE_PAGE_PRESENT(pte))   {
-    int new_fpn;
-    if (MEMPHY_get_freefp(caller->mram, &new_fpn) < 0)
-    { // RAM has no free frame
-      int vicpgn;
-      find_victim_page(caller->mm, &vicpgn);
-      uint32_t vic_pte = mm->pgd[vicpgn];
-      int vicfpn = PAGING_FPN(vic_pte);
-      int swpfpn;
-      MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
-      __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-      pte_set_swap(&mm->pgd[vicpgn], 0, swpfpn);
-      new_fpn = vicfpn;
-    }
-    pte_set_fpn(&mm->pgd[pgn], new_fpn);
+  /* Replacement may be clearing the referenced bit from another CPU */
+  pte_t pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+  int tgtfpn;
+
+  /* A fault is counted once it got its frame, not per failed attempt */
+  if ((pte & PAGING_PTE_SHM_MASK) &&
+      (!PAGING_PTE_PAGE_PRESENT(pte) || (pte & PAGING_PTE_SWAPPED_MASK)))
+  {
+    if (pg_shm_getpage(mm, pgn, fpn, caller) < 0)
+      return -1;
+    mm->pgfault++;
+    return 0;
+  }
+
+  if (!PAGING_PTE_PAGE_PRESENT(pte))
+  { /* First touch of a lazily allocated page, it reads as zeroes */
+    if (!pg_lazy_page(mm, pgn) || pg_getzeroframe(mm, &tgtfpn, caller) < 0)
+      return -1;
+    mm->pgfault++;
+    mm->pgzero++;
+    pte_set_fpn(&mm->pgd[pgn], tgtfpn);
   }
   else if (pte & PAGING_PTE_SWAPPED_MASK)
   { /* Page is not online, make it actively living */
-    int vicpgn, swpfpn;
-    int tgtfpn = PAGING_SWP(pte);
-
-    /* TODO: Play with your paging theory here */
-    /* Find victim page */
-    find_victim_page(caller->mm, &vicpgn);
-    uint32_t vic_pte = mm->pgd[vicpgn];
-    int vicfpn = PAGING_FPN(vic_pte);
-
-    /* Get free frame in MEMSWP */
-    MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
-
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy victim frame to swap */
-    //__swap_cp_page();
-    __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-    /* Copy target frame from swap to mem */
-    //__swap_cp_page();
-    __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
+    if (pg_getframe(mm, &tgtfpn, caller) < 0)
+      return -1;
+    mm->pgfault++;
 
-    /* Update page table */
-    // pte_set_swap() &mm->pgd;
-    pte_set_swap(&mm->pgd[vicpgn], 0, swpfpn);
+    /* Copy target frame from swap to mem */
+    pg_swapin(caller->mram, tgtfpn, PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
 
     /* Update its online status of the target page */
-    // pte_set_fpn() & mm->pgd[pgn];
-    pte_set_fpn(&mm->pgd[pgn], vicfpn);
+    pte_set_fpn(&mm->pgd[pgn], tgtfpn);
 
+    /* The target frame is not linked yet, readahead cannot evict it */
+    pg_readahead(mm, pgn, caller);
   }
 
-  *fpn = PAGING_FPN(mm->pgd[pgn]);
-  enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+  else
+  {
+    *fpn = PAGING_PTE_FPN(pte);
+    if (caller->mram->frmtbl[*fpn].ra && caller->mram->frmtbl[*fpn].owner == mm)
+    { /* Readahead got the page in time */
+      caller->mram->frmtbl[*fpn].ra = 0;
+      __atomic_fetch_add(&ra_nr_hit, 1, __ATOMIC_RELAXED);
+    }
+    /* The head PTE holds the referenced bit of a huge page */
+    if (pte & PAGING_PTE_HUGE_MASK)
+      pgn &= ~(mm_huge_pgn - 1);
+    pte_set_ref(&mm->pgd[pgn]);
+    return 0;
+  }
+
+  /* New mapping, let the reverse map know who owns the frame */
+  MEMPHY_put_usedfp(caller->mram, tgtfpn, mm, pgn);
+
+  *fpn = tgtfpn;
+  pte_set_ref(&mm->pgd[pgn]);
   return 0;
 }
 /*pg_getval - read value at given offset
@@ -288,11 +1034,19 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
 {
   int pgn = PAGING_PGN(addr);
   int off = PAGING_OFFST(addr);
+  pte_t pte;
   int fpn;
 
-  /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
-    return -1; /* invalid page access */
+  /* A TLB hit skips the page table walk */
+  if (tlb_lookup(mm, pgn, 0, &fpn) < 0)
+  {
+    /* Get the page to MEMRAM, swap from MEMSWAP if needed */
+    if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
+      return -1; /* invalid page access */
+    pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+    tlb_insert(mm, pgn, fpn, (pte & PAGING_PTE_DIRTY_MASK) && !(pte & PAGING_PTE_COW_MASK),
+               (pte & PAGING_PTE_HUGE_MASK) != 0);
+  }
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -311,11 +1065,27 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 {
   int pgn = PAGING_PGN(addr);
   int off = PAGING_OFFST(addr);
+  pte_t pte;
   int fpn;
 
-  /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
-    return -1; /* invalid page access */
+  /* A TLB hit skips the page table walk, unless the entry still maps
+   * a clean page, the first write goes to the PTE to mark it dirty */
+  if (tlb_lookup(mm, pgn, 1, &fpn) < 0)
+  {
+    /* Get the page to MEMRAM, swap from MEMSWAP if needed */
+    if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
+      return -1; /* invalid page access */
+
+    /* Frame shared read-only after fork, copy it before writing */
+    pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+    if ((pte & PAGING_PTE_COW_MASK) && pg_cow_break(mm, pgn, &fpn, caller) < 0)
+      return -1;
+    pte_set_dirty(&mm->pgd[pgn]);
+    /* A huge page has one dirty state, its TLB entry covers every page */
+    if (pte & PAGING_PTE_HUGE_MASK)
+      huge_set_dirty(mm, pgn);
+    tlb_insert(mm, pgn, fpn, 1, (pte & PAGING_PTE_HUGE_MASK) != 0);
+  }
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -324,6 +1094,29 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
    return 0;
 }
 
+/*pg_fault_retry - run an access that got no frame again next time slot
+ *@proc: process executing the instruction, its mm is locked
+ *@ret: result of the access
+ *
+ * Eviction skips pages mapped by a process busy on another CPU. When
+ * the processes left running share every frame, their faults all find
+ * the others busy. The instruction waits for the next time slot, when
+ * the others went on, PG_FAULT_RETRY times at most.
+ * Return 1 if the instruction is run again
+ */
+static int pg_fault_retry(struct pcb_t *proc, int ret)
+{
+  if (ret == -2 && proc->mm->pgretry < PG_FAULT_RETRY)
+  {
+    proc->mm->pgretry++;
+    proc->pc--;
+    return 1;
+  }
+
+  proc->mm->pgretry = 0;
+  return 0;
+}
+
 /*__read - read value in region memory
  *@caller: caller
  *@vmaid: ID vm area to alloc memory region
@@ -335,14 +1128,15 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
-  int vmaid = currg->vmaid;
-
-  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
-  if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  if(currg == NULL || get_vma_by_num(caller->mm, currg->vmaid) == NULL) /* Invalid memory identify */
 	  return -1;
 
-  pg_getval(caller->mm, currg->rg_start + offset, data, caller);
+  if (offset < 0 || (unsigned long)offset >= currg->rg_end - currg->rg_start)
+    return -1; /* outside the region */
+
+  if (pg_getval(caller->mm, currg->rg_start + offset, data, caller) < 0)
+    return -2; /* no frame for the page, the caller may retry */
 
   return 0;
 }
@@ -355,8 +1149,16 @@ int pgread(
 		uint32_t offset, // Source address = [source] + [offset]
 		uint32_t destination) 
 {
-  BYTE data;
-  int val = __read(proc, source, offset, &data);
+  BYTE data = 0; /* a failed access reads as zero */
+  int val;
+
+  pthread_mutex_lock(&proc->mm->lock);
+  val = __read(proc, source, offset, &data);
+  if (pg_fault_retry(proc, val))
+  {
+    pthread_mutex_unlock(&proc->mm->lock);
+    return 0;
+  }
 
   destination = (uint32_t) data;
 #ifdef IODUMP
@@ -366,6 +1168,7 @@ int pgread(
 #endif
   MEMPHY_dump(proc->mram);
 #endif
+  pthread_mutex_unlock(&proc->mm->lock);
 
   return val;
 }
@@ -381,14 +1184,15 @@ int pgread(
 int __write(struct pcb_t *caller, int rgid, int offset, BYTE value)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
-  int vmaid = currg->vmaid;
 
-  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-  
-  if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  if(currg == NULL || get_vma_by_num(caller->mm, currg->vmaid) == NULL) /* Invalid memory identify */
 	  return -1;
 
-  pg_setval(caller->mm, currg->rg_start + offset, value, caller);
+  if (offset < 0 || (unsigned long)offset >= currg->rg_end - currg->rg_start)
+    return -1; /* outside the region */
+
+  if (pg_setval(caller->mm, currg->rg_start + offset, value, caller) < 0)
+    return -2; /* no frame for the page, the caller may retry */
 
   return 0;
 }
@@ -400,17 +1204,134 @@ int pgwrite(
 		uint32_t destination, // Index of destination register
 		uint32_t offset)
 {
+  int val;
+
+  /* Page table of the process may be fixed up by other CPUs evicting */
+  pthread_mutex_lock(&proc->mm->lock);
 #ifdef IODUMP
-  printf("write region=%d offset=%d value=%d\n", destination, offset, data);
+  if (proc->mm->pgretry == 0)
+  { /* Dumped once, not again when the write waits for a frame */
+    printf("write region=%d offset=%d value=%d\n", destination, offset, data);
 #ifdef PAGETBL_DUMP
-  print_pgtbl(proc, 0, -1); //print max TBL
+    print_pgtbl(proc, 0, -1); //print max TBL
 #endif
-  MEMPHY_dump(proc->mram);
+    MEMPHY_dump(proc->mram);
+  }
 #endif
 
-  return __write(proc, destination, offset, data);
+  val = __write(proc, destination, offset, data);
+  if (pg_fault_retry(proc, val))
+    val = 0;
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return val;
+}
+
+
+/*__fork - share the address space of caller with child copy-on-write
+ *@caller: caller, its mm is locked
+ *@child: new process, its mm is allocated
+ *
+ * Only the VMAs, the symbol table and the page table are copied. Pages
+ * in MEMRAM become read-only in both processes and the frames count one
+ * more mapper, swapped pages take one more reference to their slot.
+ */
+int __fork(struct pcb_t *caller, struct pcb_t *child)
+{
+  struct mm_struct *mm = caller->mm, *cmm = child->mm;
+  struct vm_area_struct *vma, *cvma, **pcvma;
+  pte_t pte;
+  int pgn, pgend;
+
+  cmm->pgd = calloc(PAGING_MAX_PGN, sizeof(pte_t));
+  cmm->symrgtbl = malloc(mm->symrgtbl_sz * sizeof(struct vm_rg_struct));
+  memcpy(cmm->symrgtbl, mm->symrgtbl, mm->symrgtbl_sz * sizeof(struct vm_rg_struct));
+  cmm->symrgtbl_sz = mm->symrgtbl_sz;
+  cmm->vmatbl = NULL;
+  cmm->vmatbl_sz = 0;
+  cmm->resident = NULL;
+  cmm->clock_hand = NULL;
+  pthread_mutex_init(&cmm->lock, NULL);
+  cmm->tlb_hit = cmm->tlb_miss = 0;
+  cmm->pgfault = cmm->pgzero = cmm->cowfault = 0;
+  cmm->pgretry = 0;
+  cmm->ra_next = -1;
+  cmm->ra_win = 0;
+  memcg_fork(cmm, mm);
+  pff_attach(cmm, child->pid);
+  swapper_attach(cmm);
+
+  pcvma = &cmm->mmap;
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+  {
+    cvma = malloc(sizeof(struct vm_area_struct));
+    *cvma = *vma;
+    cvma->vm_mm = cmm;
+
+    freerg_copy(cvma, vma);
+    set_vma_by_num(cmm, cvma->vm_id, cvma);
+
+    *pcvma = cvma;
+    pcvma = &cvma->vm_next;
+
+    /* Shared memory stays shared, the child maps it on first access */
+    if (vma->vm_shm != NULL)
+    {
+      shm_dup(vma->vm_shm);
+      pgend = PAGING_PGN((vma->vm_end - 1));
+      for (pgn = PAGING_PGN(vma->vm_start); pgn <= pgend; pgn++)
+        cmm->pgd[pgn] = PAGING_PTE_SHM_MASK;
+      continue;
+    }
+
+    /* Share the pages mapped in the area */
+    pgend = PAGING_PGN(PAGING_PAGE_ALIGNSZ(vma->vm_end));
+    for (pgn = PAGING_PGN(vma->vm_start); pgn < pgend && pgn < PAGING_MAX_PGN; pgn++)
+    {
+      pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+      if (!PAGING_PTE_PAGE_PRESENT(pte))
+        continue;
+
+      if (pte & PAGING_PTE_SWAPPED_MASK)
+      {
+        swap_dup_slot(PAGING_PTE_SWPTYP(pte), PAGING_PTE_SWP(pte));
+        cmm->pgd[pgn] = pte;
+        continue;
+      }
+
+      /* Only base pages are shared copy-on-write */
+      if ((pte & PAGING_PTE_HUGE_MASK) && huge_split(caller->mram, mm, pgn))
+        pte = __atomic_load_n(&mm->pgd[pgn], __ATOMIC_RELAXED);
+
+      pte_set_cow(&mm->pgd[pgn]);
+      cmm->pgd[pgn] = (pte | PAGING_PTE_COW_MASK) & ~PAGING_PTE_REF_MASK;
+      MEMPHY_share_usedfp(caller->mram, PAGING_PTE_FPN(pte), cmm, pgn);
+    }
+  }
+  *pcvma = NULL;
+
+  /* Cached writable translations of the parent must fault now */
+  tlb_flush_mm(mm);
+
+  return 0;
 }
 
+/*pgfork - PAGING-based fork of the address space of a process
+ *@proc: Process executing the instruction
+ *@child: new process cloned from proc
+ */
+int pgfork(struct pcb_t *proc, struct pcb_t *child)
+{
+  int ret;
+
+  child->mm = malloc(sizeof(struct mm_struct));
+
+  pthread_mutex_lock(&proc->mm->lock);
+  ret = __fork(proc, child);
+  pthread_mutex_unlock(&proc->mm->lock);
+
+  return ret;
+}
 
 /*free_pcb_memphy - collect all memphy of pcb
  *@caller: caller
@@ -419,24 +1340,71 @@ int pgwrite(
  */
 int free_pcb_memph(struct pcb_t *caller)
 {
-  int pagenum, fpn;
-  uint32_t pte;
+  struct vm_area_struct *vma;
+  int pagenum;
 
+  pff_detach(caller->mm);
+  swapper_detach(caller->mm);
 
+  pthread_mutex_lock(&caller->mm->lock);
   for(pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++)
-  {
-    pte= caller->mm->pgd[pagenum];
+    pg_unmap_page(caller, pagenum);
 
-    if (!PAGING_PTE_PAGE_PRESENT(pte))
+  /* Segment frames went to the other attachers, drop our attachments */
+  for (vma = caller->mm->mmap; vma != NULL; vma = vma->vm_next)
+  {
+    freerg_clear(vma);
+    if (vma->vm_shm != NULL)
     {
-      fpn = PAGING_PTE_FPN(pte);
-      MEMPHY_put_freefp(caller->mram, fpn);
-    } else {
-      fpn = PAGING_PTE_SWP(pte);
-      MEMPHY_put_freefp(caller->active_mswp, fpn);    
+      shm_put(vma->vm_shm, caller->mram);
+      vma->vm_shm = NULL;
     }
   }
 
+  tlb_flush_mm(caller->mm);
+
+  /* Nothing resolves a region or a VMA ID of a finished process */
+  free(caller->mm->symrgtbl);
+  caller->mm->symrgtbl = NULL;
+  caller->mm->symrgtbl_sz = 0;
+  free(caller->mm->vmatbl);
+  caller->mm->vmatbl = NULL;
+  caller->mm->vmatbl_sz = 0;
+  pthread_mutex_unlock(&caller->mm->lock);
+
+  return 0;
+}
+
+/*readahead_report - print how useful swap-in readahead was
+ *
+ */
+int readahead_report(void)
+{
+  long done = ra_nr_hit + ra_nr_miss;
+
+  if (mm_ra_max <= 0)
+    return 0;
+
+  printf("----------------SWAP READAHEAD-------------- \n");
+  printf("max window=%d pages read ahead=%ld hit=%ld miss=%ld hit rate=%.2f%%\n",
+         mm_ra_max, ra_nr_read, ra_nr_hit, ra_nr_miss,
+         done ? 100.0 * ra_nr_hit / done : 0.0);
+
+  return 0;
+}
+
+/*sbrk_report - print how many break growths the reservations saved
+ *
+ */
+int sbrk_report(void)
+{
+  if (sbrk_rsv_bytes == 0)
+    return 0;
+
+  printf("----------------HEAP GROWTH-------------- \n");
+  printf("reservation max=%d bytes growths=%ld avoided=%ld reserved ahead=%ld bytes\n",
+         mm_sbrk_max, sbrk_nr_grow, sbrk_nr_saved, sbrk_rsv_bytes);
+
   return 0;
 }
 
@@ -513,11 +1481,14 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz,
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
   int old_end = cur_vma->vm_end;
+  unsigned long old_sbrk = cur_vma->sbrk, old_grow = cur_vma->vm_grow;
+  int rsv_amt = inc_amt, ret = 0;
 
   /*Validate overlap of obtained region */
   if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) < 0) {
     printf("Overlaped vm_area regions\n");
     free(newrg);
+    free(area);
     return -1; /*Overlap and failed allocation */
   }
   
@@ -553,44 +1524,105 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz,
   // return *inc_limit_ret;
 
 
-  cur_vma->vm_end += inc_sz;
-  cur_vma->sbrk += inc_sz;
+  /* Reserve ahead so that the next allocations are served below the
+   * break, a reservation running into another VMA takes the request only */
+  if ((unsigned long)inc_amt < cur_vma->vm_grow &&
+      area->rg_start + cur_vma->vm_grow <= BIT(PAGING_CPU_BUS_WIDTH) &&
+      validate_overlap_vm_area(caller, vmaid, area->rg_start,
+                               area->rg_start + cur_vma->vm_grow) == 0)
+    rsv_amt = cur_vma->vm_grow;
+  if (cur_vma->vm_grow * 2 <= (unsigned long)mm_sbrk_max)
+    cur_vma->vm_grow *= 2;
+
+  cur_vma->vm_end += rsv_amt;
+  cur_vma->sbrk += rsv_amt;
+
+  /* Lazy mode only reserves the virtual space, pages are mapped by
+   * pg_getpage on their first access. Otherwise the rest of the
+   * reservation is mapped by the allocations using it */
+  if (!mm_lazy_alloc &&
+      vm_map_ram(caller, area->rg_start, area->rg_end, old_end, incnumpage , newrg) < 0)
+  { /* Map the memory to MEMRAM failed, the break does not move */
+    cur_vma->vm_end = old_end;
+    cur_vma->sbrk = old_sbrk;
+    cur_vma->vm_grow = old_grow;
+    ret = -1;
+  }
+  else
+  {
+    __atomic_fetch_add(&sbrk_nr_grow, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sbrk_rsv_bytes, rsv_amt - inc_amt, __ATOMIC_RELAXED);
+  }
 
-  if (vm_map_ram(caller, area->rg_start, area->rg_end, old_end, incnumpage , newrg) < 0)
-    return -1; /* Map the memory to MEMRAM */
-  return 0;
+  free(newrg);
+  free(area);
+  return ret;
 }
 
-/*find_victim_page - find victim page
- *@caller: caller
- *@pgn: return page number
+/*find_victim_page - find victim page among the pages of mm
+ *@mram: MEMRAM
+ *@mm: faulting mm, already locked by the caller
+ *@retpgn: return page number
+ *@retfpn: return frame number
  *
  */
-int find_victim_page(struct mm_struct *mm, int *retpgn) 
+int find_victim_page(struct memphy_struct *mram, struct mm_struct *mm,
+                     int *retpgn, int *retfpn)
 {
-  struct pgn_t *pg = mm->fifo_pgn;
+  struct framephy_struct *fp;
 
-  /* TODO: Implement the theorical mechanism to find the victim page */
-  if (!pg) {
+  pthread_mutex_lock(&mram->fp_lock);
+  fp = repl_select(&mm->resident, &mm->clock_hand, 1, mm);
+  if (fp == NULL)
+  {
+    pthread_mutex_unlock(&mram->fp_lock);
     return -1;
   }
-  if (!pg->pg_next) {
-    *retpgn = pg->pgn;
-    free(pg);
-    mm->fifo_pgn = NULL;
-  }
-  else {
-    struct pgn_t *pre = mm->fifo_pgn;
-    while (pre->pg_next->pg_next) {
-      pre = pre->pg_next;
-      pg = pg->pg_next;
-      }
 
-    pg = pg->pg_next;
-    pre->pg_next = NULL;
-    *retpgn = pg->pgn;
-    free(pg);
+  *retpgn = fp->pgn;
+  *retfpn = fp->fpn;
+  /* Only the head page of a huge page goes, the rest stays mapped */
+  if (fp->huge)
+    huge_split_locked(mram, fp);
+  MEMPHY_unlink_usedfp(mram, fp);
+  pthread_mutex_unlock(&mram->fp_lock);
+
+  return 0;
+}
+
+/*find_victim_frame - find victim frame among every process
+ *@mram: MEMRAM
+ *@mm: faulting mm, already locked by the caller
+ *@vicmm: return owner of the victim, locked if it is not mm
+ *@vicpgn: return page number in the owner
+ *@vicfpn: return frame number
+ *
+ * Run the replacement policy on the reverse map. Owners busy on
+ * another CPU are skipped, trylock keeps two faulting CPUs from waiting
+ * on each other mm.
+ */
+int find_victim_frame(struct memphy_struct *mram, struct mm_struct *mm,
+                      struct mm_struct **vicmm, int *vicpgn, int *vicfpn)
+{
+  struct framephy_struct *fp;
+
+  pthread_mutex_lock(&mram->fp_lock);
+  fp = repl_select(&mram->used_fp_list, &mram->clock_hand, 0, mm);
+  if (fp == NULL)
+  {
+    pthread_mutex_unlock(&mram->fp_lock);
+    return -1;
   }
+
+  *vicmm = fp->owner;
+  *vicpgn = fp->pgn;
+  *vicfpn = fp->fpn;
+  /* Only the head page of a huge page goes, the rest stays mapped */
+  if (fp->huge)
+    huge_split_locked(mram, fp);
+  MEMPHY_unlink_usedfp(mram, fp);
+  pthread_mutex_unlock(&mram->fp_lock);
+
   return 0;
 }
 
@@ -604,59 +1636,11 @@ int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_s
 {
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
-  struct vm_rg_struct *rgit = cur_vma->vm_freerg_list;
-
-  if (rgit == NULL)
+  if (cur_vma == NULL || cur_vma->vm_shm != NULL)
     return -1;
 
-  /* Probe unintialized newrg */
-  newrg->rg_start = newrg->rg_end = -1;
-
-  /* Traverse on list of free vm region to find a fit space */
-  while (rgit != NULL && rgit->vmaid == vmaid)
-  {
-    if (rgit->rg_start + size <= rgit->rg_end)
-    { /* Current region has enough space */
-      newrg->rg_start = rgit->rg_start;
-      newrg->rg_end = rgit->rg_start + size;
-
-      /* Update left space in chosen region */
-      if (rgit->rg_start + size < rgit->rg_end)
-      {
-        rgit->rg_start = rgit->rg_start + size;
-      }
-      else
-      { /*Use up all space, remove current node */
-        /*Clone next rg node */
-        struct vm_rg_struct *nextrg = rgit->rg_next;
-
-        /*Cloning */
-        if (nextrg != NULL)
-        {
-          rgit->rg_start = nextrg->rg_start;
-          rgit->rg_end = nextrg->rg_end;
-
-          rgit->rg_next = nextrg->rg_next;
-
-          free(nextrg);
-        }
-        else
-        { /*End of free list */
-          rgit->rg_start = rgit->rg_end;	//dummy, size 0 region
-          rgit->rg_next = NULL;
-        }
-      }
-    }
-    else
-    {
-      rgit = rgit->rg_next;	// Traverse next rg
-    }
-  }
-
- if(newrg->rg_start == -1) // new region not found
-   return -1;
-
- return 0;
+  /* Best fit among the free ranges of the area */
+  return freerg_take(cur_vma, size, newrg);
 }
 
 //#endif
@@ -0,0 +1,116 @@
+/*
+ * PAGING based Memory Management
+ * Pre-zeroed frame pool mm/mm-zero.c
+ *
+ * A freed frame keeps the bytes of its last owner, so every frame
+ * handed to a new mapping is cleared first. A worker runs once per
+ * time slot next to the CPUs and keeps up to mm_zero_pool free frames
+ * cleared ahead, a fault needing a clean frame takes one of them and
+ * only clears a frame by itself when the pool ran dry.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef MM_PAGING
+int mm_zero_pool = 0; /* 0 keeps the pool and its worker off */
+
+/* Statistics */
+static long zero_nr_hit, zero_nr_miss;    /* clean frames from the pool or cleared inline */
+static long zero_nr_bg;                   /* frames cleared by the worker */
+static long zero_bg_ns, zero_inline_ns;   /* host time spent clearing */
+
+static long zero_elapsed(struct timespec *t0)
+{
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000000000L + (t1.tv_nsec - t0->tv_nsec);
+}
+
+/*
+ *  zero_frame - clear a frame in the fault path
+ *  @mram: MEMRAM
+ *  @fpn: frame taken outside the pool
+ */
+void zero_frame(struct memphy_struct *mram, int fpn)
+{
+  struct timespec t0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  MEMPHY_zero_frame(mram, fpn);
+  __atomic_fetch_add(&zero_inline_ns, zero_elapsed(&t0), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&zero_nr_miss, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *  zero_getfp - get a free frame filled with zeroes
+ *  @mram: MEMRAM
+ *  @fpn: return frame
+ *  Return 0 on success, -1 if MEMRAM has no free frame
+ */
+int zero_getfp(struct memphy_struct *mram, int *fpn)
+{
+  if (MEMPHY_get_zerofp(mram, fpn) == 0)
+  {
+    __atomic_fetch_add(&zero_nr_hit, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  if (MEMPHY_get_freefp(mram, fpn) < 0)
+    return -1;
+
+  zero_frame(mram, *fpn);
+  return 0;
+}
+
+/*
+ *  zero_refill - clear free frames until the pool is full
+ *  @mram: MEMRAM
+ *  Called by the worker once per time slot
+ *  Return the number of frames cleared
+ */
+int zero_refill(struct memphy_struct *mram)
+{
+  struct timespec t0;
+  int nr;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  nr = MEMPHY_fill_zerofp(mram);
+  if (nr > 0)
+  {
+    zero_bg_ns += zero_elapsed(&t0);
+    zero_nr_bg += nr;
+  }
+
+  return nr;
+}
+
+/*
+ *  zero_report - print pool hits and the cost of clearing frames
+ *  Host time differs from run to run, it is only printed under VMDBG
+ */
+int zero_report(void)
+{
+  long nr = zero_nr_hit + zero_nr_miss;
+
+  if (mm_zero_pool <= 0)
+    return 0;
+
+  printf("----------------ZEROED FRAME POOL-------------- \n");
+  printf("pool=%d frames clean frames taken=%ld pool hit=%ld miss=%ld hit rate=%.2f%%\n",
+         mm_zero_pool, nr, zero_nr_hit, zero_nr_miss,
+         nr ? 100.0 * zero_nr_hit / nr : 0.0);
+#ifdef VMDBG
+  printf("cleared in background=%ld (%.0fns per frame) in the fault path=%ld (%.0fns per frame)\n",
+         zero_nr_bg, zero_nr_bg ? (double)zero_bg_ns / zero_nr_bg : 0.0,
+         zero_nr_miss, zero_nr_miss ? (double)zero_inline_ns / zero_nr_miss : 0.0);
+#else
+  printf("cleared in background=%ld in the fault path=%ld\n", zero_nr_bg, zero_nr_miss);
+#endif
+
+  return 0;
+}
+#endif
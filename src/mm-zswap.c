@@ -0,0 +1,299 @@
+/*
+ * PAGING based Memory Management
+ * Compressed swap cache mm/mm-zswap.c
+ *
+ * Pages evicted from MEMRAM are first compressed into an in-memory
+ * pool keyed by their swap slot. A page only reaches its MEMSWP device
+ * when the pool is full or the page does not compress, and swap-ins
+ * are served from the pool whenever the slot is found there.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef MM_PAGING
+#define ZSWAP_NR_BUCKET 1024
+#define ZSWAP_RUN_MIN 3      /* shorter repeats are kept as literal */
+#define ZSWAP_RUN_MAX (0x7f + ZSWAP_RUN_MIN)
+#define ZSWAP_LIT_MAX 0x80
+
+struct zswap_entry {
+  int swptyp;
+  int swpoff;
+  int clen;
+  BYTE *data;
+  struct zswap_entry *next;
+};
+
+static struct zswap_entry *zswap_tbl[ZSWAP_NR_BUCKET];
+static pthread_mutex_t zswap_lock = PTHREAD_MUTEX_INITIALIZER;
+static long zswap_pool_sz;     /* pool capacity in bytes, 0 disables it */
+static long zswap_pool_used;
+
+/* Statistics */
+static long zswap_nr_stored, zswap_nr_reject_full, zswap_nr_reject_poor;
+static long zswap_nr_hit, zswap_nr_miss;
+static long zswap_orig_bytes, zswap_comp_bytes;
+
+/*
+ *  zswap_compress - run length encode a page
+ *  @src: page content
+ *  @dst: output buffer, must hold at least PAGING_PAGESZ bytes
+ *  Return compressed length, or -1 if it would not be smaller than the page
+ *
+ *  Control byte 0x00..0x7f : (n + 1) literal bytes follow
+ *  Control byte 0x80..0xff : next byte repeated (n & 0x7f) + ZSWAP_RUN_MIN times
+ */
+static int zswap_compress(const BYTE *src, BYTE *dst)
+{
+  int in = 0, out = 0, run, lit;
+
+  while (in < PAGING_PAGESZ)
+  {
+    run = 1;
+    while (in + run < PAGING_PAGESZ && run < ZSWAP_RUN_MAX && src[in + run] == src[in])
+      run++;
+
+    if (run >= ZSWAP_RUN_MIN)
+    {
+      if (out + 2 >= PAGING_PAGESZ)
+        return -1;
+      dst[out++] = (BYTE)(0x80 | (run - ZSWAP_RUN_MIN));
+      dst[out++] = src[in];
+      in += run;
+      continue;
+    }
+
+    /* Collect literals up to the next worthwhile repeat */
+    lit = 0;
+    while (in + lit < PAGING_PAGESZ && lit < ZSWAP_LIT_MAX)
+    {
+      if (in + lit + 2 < PAGING_PAGESZ &&
+          src[in + lit] == src[in + lit + 1] && src[in + lit] == src[in + lit + 2])
+        break;
+      lit++;
+    }
+
+    if (out + 1 + lit >= PAGING_PAGESZ)
+      return -1;
+    dst[out++] = (BYTE)(lit - 1);
+    memcpy(&dst[out], &src[in], lit);
+    out += lit;
+    in += lit;
+  }
+
+  return out;
+}
+
+/*
+ *  zswap_decompress - decode a page encoded by zswap_compress
+ */
+static void zswap_decompress(const BYTE *src, int clen, BYTE *dst)
+{
+  int in = 0, out = 0, n;
+  unsigned char ctl;
+
+  while (in < clen && out < PAGING_PAGESZ)
+  {
+    ctl = (unsigned char)src[in++];
+    if (ctl & 0x80)
+    {
+      n = (ctl & 0x7f) + ZSWAP_RUN_MIN;
+      memset(&dst[out], src[in++], n);
+    }
+    else
+    {
+      n = ctl + 1;
+      memcpy(&dst[out], &src[in], n);
+      in += n;
+    }
+    out += n;
+  }
+}
+
+static struct zswap_entry **zswap_slot(int swptyp, int swpoff)
+{
+  unsigned int h = ((unsigned int)swpoff * 31u + (unsigned int)swptyp) % ZSWAP_NR_BUCKET;
+
+  return &zswap_tbl[h];
+}
+
+/*
+ *  init_zswap - set up the compressed swap cache
+ *  @pool_sz: pool size in bytes, 0 keeps the cache disabled
+ */
+int init_zswap(long pool_sz)
+{
+  zswap_pool_sz = (pool_sz > 0) ? pool_sz : 0;
+  zswap_pool_used = 0;
+
+  return 0;
+}
+
+/*
+ *  zswap_store - compress a frame into the pool
+ *  @mp: memphy holding the frame
+ *  @fpn: frame to store
+ *  @swptyp, @swpoff: swap slot the page is assigned to
+ *  Return 0 if the pool took the page, -1 if it must go to the swap device
+ */
+int zswap_store(struct memphy_struct *mp, int fpn, int swptyp, int swpoff)
+{
+  BYTE page[PAGING_PAGESZ], comp[PAGING_PAGESZ];
+  struct zswap_entry *ze, **head;
+  int i, clen;
+
+  if (zswap_pool_sz == 0)
+    return -1;
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+    MEMPHY_read(mp, fpn * PAGING_PAGESZ + i, &page[i]);
+
+  clen = zswap_compress(page, comp);
+
+  pthread_mutex_lock(&zswap_lock);
+  if (clen < 0)
+  {
+    zswap_nr_reject_poor++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+  if (zswap_pool_used + clen > zswap_pool_sz)
+  {
+    zswap_nr_reject_full++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+  zswap_pool_used += clen;
+  zswap_nr_stored++;
+  zswap_orig_bytes += PAGING_PAGESZ;
+  zswap_comp_bytes += clen;
+  pthread_mutex_unlock(&zswap_lock);
+
+  ze = malloc(sizeof(struct zswap_entry));
+  ze->swptyp = swptyp;
+  ze->swpoff = swpoff;
+  ze->clen = clen;
+  ze->data = malloc(clen);
+  memcpy(ze->data, comp, clen);
+
+  pthread_mutex_lock(&zswap_lock);
+  head = zswap_slot(swptyp, swpoff);
+  ze->next = *head;
+  *head = ze;
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*
+ *  zswap_unlink - take the entry of a swap slot out of the pool
+ *  Caller must hold zswap_lock
+ */
+static struct zswap_entry *zswap_unlink(int swptyp, int swpoff)
+{
+  struct zswap_entry **pze = zswap_slot(swptyp, swpoff);
+  struct zswap_entry *ze;
+
+  for (; *pze != NULL; pze = &(*pze)->next)
+    if ((*pze)->swptyp == swptyp && (*pze)->swpoff == swpoff)
+    {
+      ze = *pze;
+      *pze = ze->next;
+      zswap_pool_used -= ze->clen;
+      return ze;
+    }
+
+  return NULL;
+}
+
+/*
+ *  zswap_load - bring a page back from the pool
+ *  @mp: memphy receiving the page
+ *  @fpn: destination frame
+ *  @swptyp, @swpoff: swap slot of the page
+ *  Return 0 on a pool hit, -1 if the page lives on the swap device
+ *
+ *  The entry stays pooled, like the swap slot it is the copy a clean
+ *  page falls back to when it is evicted again. It goes away when the
+ *  slot is released or rewritten by a dirty page
+ */
+int zswap_load(struct memphy_struct *mp, int fpn, int swptyp, int swpoff)
+{
+  BYTE page[PAGING_PAGESZ];
+  struct zswap_entry *ze;
+  int i;
+
+  if (zswap_pool_sz == 0)
+    return -1;
+
+  pthread_mutex_lock(&zswap_lock);
+  for (ze = *zswap_slot(swptyp, swpoff); ze != NULL; ze = ze->next)
+    if (ze->swptyp == swptyp && ze->swpoff == swpoff)
+      break;
+
+  if (ze == NULL)
+  {
+    zswap_nr_miss++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+
+  zswap_nr_hit++;
+  zswap_decompress(ze->data, ze->clen, page);
+  pthread_mutex_unlock(&zswap_lock);
+
+  for (i = 0; i < PAGING_PAGESZ; i++)
+    MEMPHY_write(mp, fpn * PAGING_PAGESZ + i, page[i]);
+
+  return 0;
+}
+
+/*
+ *  zswap_invalidate - drop the pooled copy of a released or rewritten slot
+ */
+void zswap_invalidate(int swptyp, int swpoff)
+{
+  struct zswap_entry *ze;
+
+  if (zswap_pool_sz == 0)
+    return;
+
+  pthread_mutex_lock(&zswap_lock);
+  ze = zswap_unlink(swptyp, swpoff);
+  pthread_mutex_unlock(&zswap_lock);
+
+  if (ze != NULL)
+  {
+    free(ze->data);
+    free(ze);
+  }
+}
+
+/*
+ *  zswap_report - print compression ratio and hit rate of the pool
+ */
+int zswap_report(void)
+{
+  long nr_load = zswap_nr_hit + zswap_nr_miss;
+
+  if (zswap_pool_sz == 0)
+    return 0;
+
+  printf("----------------ZSWAP POOL-------------- \n");
+  printf("pool=%ld used=%ld stored=%ld reject_full=%ld reject_poor=%ld\n",
+         zswap_pool_sz, zswap_pool_used, zswap_nr_stored,
+         zswap_nr_reject_full, zswap_nr_reject_poor);
+  printf("compression ratio=%.2f (%ld -> %ld bytes)\n",
+         zswap_comp_bytes ? (double)zswap_orig_bytes / zswap_comp_bytes : 0.0,
+         zswap_orig_bytes, zswap_comp_bytes);
+  printf("swapin hit=%ld miss=%ld hit rate=%.2f%%\n",
+         zswap_nr_hit, zswap_nr_miss,
+         nr_load ? 100.0 * zswap_nr_hit / nr_load : 0.0);
+
+  return 0;
+}
+#endif
@@ -7,11 +7,72 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+
+int mm_pagesz = PAGING_DEF_PAGESZ;
+int mm_page_shift;
+int mm_bus_width = PAGING_DEF_BUS_WIDTH;
+
+/*
+ * init_paging - check the paging geometry against the memory devices
+ * @ramsz : MEMRAM size in bytes
+ * @swpsz : MEMSWP sizes in bytes
+ * @nswp  : number of MEMSWP
+ * Return -1 if the page size or bus width is invalid or a device has
+ * more frames than a PTE can address
+ */
+int init_paging(int ramsz, int *swpsz, int nswp)
+{
+  int sit;
+
+  if (mm_pagesz < PAGING_MIN_PAGESZ || mm_pagesz > PAGING_MAX_PAGESZ ||
+      (mm_pagesz & (mm_pagesz - 1)) != 0)
+  {
+    printf("Page size %d is not a power of two in [%d, %d]\n",
+           mm_pagesz, PAGING_MIN_PAGESZ, PAGING_MAX_PAGESZ);
+    return -1;
+  }
+
+  for (mm_page_shift = 0; (1 << mm_page_shift) < mm_pagesz; mm_page_shift++)
+    ;
+
+  if (mm_bus_width <= mm_page_shift || mm_bus_width > PAGING_MAX_BUS_WIDTH)
+  {
+    printf("Bus width %d must hold a page and be at most %d bits\n",
+           mm_bus_width, PAGING_MAX_BUS_WIDTH);
+    return -1;
+  }
+
+  if (mm_huge_pgn != 0 && (mm_huge_pgn < 2 || mm_huge_pgn > PAGING_MAX_PGN ||
+                           (mm_huge_pgn & (mm_huge_pgn - 1)) != 0))
+  {
+    printf("Huge page of %d pages is not a power of two in [2, %d]\n",
+           mm_huge_pgn, PAGING_MAX_PGN);
+    return -1;
+  }
+
+  if ((unsigned long long)(ramsz / mm_pagesz) > PAGING_PTE_MAX_FPN + 1)
+  {
+    printf("MEMRAM of %d bytes exceeds the %llu frames a PTE addresses\n",
+           ramsz, (unsigned long long)PAGING_PTE_MAX_FPN + 1);
+    return -1;
+  }
+
+  for (sit = 0; sit < nswp; sit++)
+    if ((unsigned long long)(swpsz[sit] / mm_pagesz) > PAGING_PTE_MAX_SWPOFF + 1)
+    {
+      printf("MEMSWP%d of %d bytes exceeds the %llu slots a PTE addresses\n",
+             sit, swpsz[sit], (unsigned long long)PAGING_PTE_MAX_SWPOFF + 1);
+      return -1;
+    }
+
+  return 0;
+}
 
 /* 
  * init_pte - Initialize PTE entry
  */
-int init_pte(uint32_t *pte,
+int init_pte(pte_t *pte,
              int pre,    // present
              int fpn,    // FPN
              int drt,    // dirty
@@ -49,10 +110,11 @@ int init_pte(uint32_t *pte,
  * @swptyp : swap type
  * @swpoff : swap offset
  */
-int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
+int pte_set_swap(pte_t *pte, int swptyp, int swpoff)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_DIRTY_MASK); /* the swap slot holds the data */
 
   SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
   SETVAL(*pte, swpoff, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
@@ -65,16 +127,58 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
  * @pte   : target page table entry (PTE)
  * @fpn   : frame page number (FPN)
  */
-int pte_set_fpn(uint32_t *pte, int fpn)
+int pte_set_fpn(pte_t *pte, int fpn)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
 
+  /* Drop the stale swap offset left by a swapped out page */
+  CLRBIT(*pte, PAGING_PTE_SWPOFF_MASK);
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT); 
 
   return 0;
 }
 
+/* 
+ * pte_set_ref - mark an on-line page referenced
+ * @pte   : target page table entry (PTE)
+ * Replacement may clear the bit from another CPU, both sides are atomic
+ */
+void pte_set_ref(pte_t *pte)
+{
+  __atomic_fetch_or(pte, PAGING_PTE_REF_MASK, __ATOMIC_RELAXED);
+}
+
+/* 
+ * pte_set_dirty - mark an on-line page written
+ * @pte   : target page table entry (PTE)
+ */
+void pte_set_dirty(pte_t *pte)
+{
+  __atomic_fetch_or(pte, PAGING_PTE_DIRTY_MASK, __ATOMIC_RELAXED);
+}
+
+/* 
+ * pte_set_cow - share an on-line page read-only until its next write
+ * @pte   : target page table entry (PTE)
+ */
+void pte_set_cow(pte_t *pte)
+{
+  __atomic_fetch_or(pte, PAGING_PTE_COW_MASK, __ATOMIC_RELAXED);
+}
+
+/* 
+ * pte_test_clear_ref - clear the referenced bit of an on-line page
+ * @pte   : target page table entry (PTE)
+ * Return 1 if the page was referenced since the last clear
+ */
+int pte_test_clear_ref(pte_t *pte)
+{
+  return (__atomic_fetch_and(pte, ~PAGING_PTE_REF_MASK, __ATOMIC_RELAXED) &
+          PAGING_PTE_REF_MASK) ? 1 : 0;
+}
+
 
 /* 
  * vmap_page_range - map a range of page at aligned address
@@ -85,8 +189,7 @@ int vmap_page_range(struct pcb_t *caller,
                     struct framephy_struct *frames, 
                     struct vm_rg_struct *ret_rg)
 {
-    // uint32_t * pte = malloc(sizeof(uint32_t));
-  struct framephy_struct *fpit = malloc(sizeof(struct framephy_struct));
+  struct framephy_struct *fpit = frames;
   // int  fpn;
   int pgit = 0;
   int pgn = PAGING_PGN(addr);
@@ -103,10 +206,17 @@ int vmap_page_range(struct pcb_t *caller,
     if (fpit == NULL) {
       return -1; // Error: insufficient frames
     }
-    uint32_t *pte = &caller->mm->pgd[pgn + pgit];
-    pte_set_fpn(pte, fpit->fpn);
-    fpit = fpit->fp_next;
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn + pgit);
+    pte_t *pte = &caller->mm->pgd[pgn + pgit];
+    if (fpit->in_RAM) {
+      pte_set_fpn(pte, fpit->fpn);
+      MEMPHY_put_usedfp(caller->mram, fpit->fpn, caller->mm, pgn + pgit);
+    } else {
+      /* Frame was taken from a swap device, map it as swapped page */
+      pte_set_swap(pte, fpit->swptyp, fpit->fpn);
+    }
+    struct framephy_struct *fpnext = fpit->fp_next;
+    free(fpit);
+    fpit = fpnext;
   }
   return 0;
 }
@@ -120,7 +230,7 @@ int vmap_page_range(struct pcb_t *caller,
 
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct** frm_lst)
 {
-  int pgit, fpn;// fpn: số khung trang
+  int pgit, fpn, swptyp;// fpn: số khung trang
   if(req_pgnum > (caller->mram->maxsz / PAGING_PAGESZ))// kích thước tối đa của bộ nhớ
     return -1;
   /* TODO: allocate the page
@@ -128,6 +238,7 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
   //frm_lst-> ...
   */
   struct framephy_struct *tail = NULL;
+  int room = memcg_room(caller->mm);
 
   //Vong lap qua tung trang yeu cau
     for (pgit = 0; pgit < req_pgnum; pgit++) {
@@ -136,16 +247,29 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
             return -1;
         
         //Cap phat mot khung trang trong tu ram
-        if (MEMPHY_get_freefp(caller->mram, &fpn) == 0) {
+        /* A recycled frame or slot must not show its last owner's bytes */
+        if (room <= 0 && pg_evict_own_frame(caller->mram, caller->mm, &fpn) == 0) {
+            /* At its resident limit the process gives up one of its pages */
+            zero_frame(caller->mram, fpn);
+            new_fp->fpn = fpn;
+            new_fp->in_RAM = 1;
+        } else if (room > 0 && zero_getfp(caller->mram, &fpn) == 0) {
+            room--;
             new_fp->fpn = fpn;
             new_fp->in_RAM = 1; // Khung này trong RAM
-        } else if (MEMPHY_get_freefp(caller->active_mswp, &fpn) == 0) { // Neu khong co khung trang trong tu RAM, vao vungf swap
+        } else if (swap_get_slot(&swptyp, &fpn) == 0) { // Neu khong co khung trang trong tu RAM, vao vungf swap
+            MEMPHY_zero_frame(swap_dev(swptyp), fpn);
             new_fp->fpn = fpn;
             new_fp->in_RAM = 0; // Khung này trong SWAP
+            new_fp->swptyp = swptyp;
         } else {
             // Neu khong du bo nho, giai phong toan bo du lieu da cap phat trc do
             while (*frm_lst) {
                 struct framephy_struct *temp = (*frm_lst)->fp_next;
+                if ((*frm_lst)->in_RAM)
+                    MEMPHY_put_freefp(caller->mram, (*frm_lst)->fpn);
+                else
+                    swap_put_slot((*frm_lst)->swptyp, (*frm_lst)->fpn);
                 free(*frm_lst);
                 *frm_lst = temp;
             }
@@ -182,32 +306,61 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 {
   struct framephy_struct *frm_lst = NULL;
   int ret_alloc;
+  int pgn = PAGING_PGN(mapstart), pgend = pgn + incpgnum, run;
 
-  /*@bksysnet: author provides a feasible solution of getting frames
-   *FATAL logic in here, wrong behaviour if we have not enough page
-   *i.e. we request 1000 frames meanwhile our RAM has size of 3 frames
-   *Don't try to perform that case in this simple work, it will result
-   *in endless procedure of swap-off to get frame and we have not provide 
-   *duplicate control mechanism, keep it simple
-   */
-  ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst);
-
-  if (ret_alloc < 0 && ret_alloc != -3000)
-    return -1;
-
-  /* Out of memory */
-  if (ret_alloc == -3000) 
+  /* Aligned spans covering a whole huge page are mapped by one, the rest
+   * of the range and the spans MEMRAM cannot hold in one piece go page
+   * by page, never across a huge page boundary */
+  for (; pgn < pgend; pgn += run)
   {
+    if (mm_huge_pgn > 0 && (pgn & (mm_huge_pgn - 1)) == 0 &&
+        pgn + mm_huge_pgn <= pgend && memcg_room(caller->mm) >= mm_huge_pgn &&
+        huge_map(caller, pgn) == 0)
+    {
+      run = mm_huge_pgn;
+      continue;
+    }
+
+    run = pgend - pgn;
+    if (mm_huge_pgn > 0 && run > mm_huge_pgn - (pgn & (mm_huge_pgn - 1)))
+      run = mm_huge_pgn - (pgn & (mm_huge_pgn - 1));
+
+    /*@bksysnet: author provides a feasible solution of getting frames
+     *FATAL logic in here, wrong behaviour if we have not enough page
+     *i.e. we request 1000 frames meanwhile our RAM has size of 3 frames
+     *Don't try to perform that case in this simple work, it will result
+     *in endless procedure of swap-off to get frame and we have not provide 
+     *duplicate control mechanism, keep it simple
+     */
+    ret_alloc = alloc_pages_range(caller, run, &frm_lst);
+
+    /* Neither RAM, nor room in the group, nor swap left, make room by
+     * killing a process */
+    while (ret_alloc == -3000 && oom_kill(caller, run) == 0)
+      ret_alloc = alloc_pages_range(caller, run, &frm_lst);
+
+    /* Out of memory */
+    if (ret_alloc < 0)
+    {
 #ifdef MMDBG
-     printf("OOM: vm_map_ram out of memory \n");
+      if (ret_alloc == -3000)
+        printf("OOM: vm_map_ram out of memory \n");
 #endif
-     return -1;
-  }
+      /* Give back what the range already mapped */
+      while (pgn > PAGING_PGN(mapstart))
+        pg_unmap_page(caller, --pgn);
+      return -1;
+    }
 
-  /* it leaves the case of memory is enough but half in ram, half in swap
-   * do the swaping all to swapper to get the all in ram */
-  vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
+    /* it leaves the case of memory is enough but half in ram, half in swap
+     * do the swaping all to swapper to get the all in ram */
+    vmap_page_range(caller, pgn * PAGING_PAGESZ, run, frm_lst, ret_rg);
+    if (mm_huge_pgn > 0)
+      huge_account_base(run);
+  }
 
+  ret_rg->rg_start = mapstart;
+  ret_rg->rg_end = mapstart + incpgnum * PAGING_PAGESZ;
   return 0;
 }
 
@@ -222,6 +375,7 @@ int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
 {
   int cellidx;
   int addrsrc,addrdst;
+
   for(cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
   {
     addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
@@ -232,6 +386,9 @@ int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
     MEMPHY_write(mpdst, addrdst, data);
   }
 
+  /* Page level write back when the destination is a file backed swap */
+  MEMPHY_sync_frame(mpdst, dstfpn);
+
   return 0;
 }
 
@@ -246,46 +403,69 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   struct vm_area_struct *vma0 = malloc(sizeof(struct vm_area_struct));
   struct vm_area_struct *vma1 = malloc(sizeof(struct vm_area_struct));
   /*Khởi tạo bảng trang*/
-  mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  mm->pgd = calloc(PAGING_MAX_PGN, sizeof(pte_t));
 
   if (!vma0 || !mm->pgd || !vma1)
     return -1;
 
-  for (int i = 0; i < PAGING_MAX_PGN; i++) {
-    mm->pgd[i] = 0;
-  }
-
   /* By default the owner comes with at least one vma for DATA */
   vma0->vm_id = 0;
   vma0->vm_start = 0;
   vma0->vm_end = vma0->vm_start;
   vma0->sbrk = vma0->vm_start;
+  vma0->vm_grow = PAGING_SBRK_INIT_SZ;
+  vma0->vm_used = vma0->vm_start;
   /*Khởi tạo và thêm vùng nhớ tự  dođầu vào VMA0*/
-  struct vm_rg_struct *first_rg = init_vm_rg(vma0->vm_start, vma0->vm_end, 0);
-  enlist_vm_rg_node(&vma0->vm_freerg_list, first_rg);
+  vma0->vm_freerg[FREERG_BY_ADDR] = vma0->vm_freerg[FREERG_BY_SIZE] = NULL;
 
   /*Thiết lập cho heap-VMA1*/
   vma1->vm_id = 1;
   vma1->vm_start = caller->vmemsz;
   vma1->vm_end = vma1->vm_start;
   vma1->sbrk = vma1->vm_start;
+  vma1->vm_grow = PAGING_SBRK_INIT_SZ;
+  vma1->vm_used = vma1->vm_start;
   /*Khởi tạo và thêm vùng nhớ tự  dođầu vào VMA1*/
-  struct vm_rg_struct *heap_rg = init_vm_rg(vma1->vm_start, vma1->vm_end, 1);
-  enlist_vm_rg_node(&vma1->vm_freerg_list, heap_rg);
+  vma1->vm_freerg[FREERG_BY_ADDR] = vma1->vm_freerg[FREERG_BY_SIZE] = NULL;
 
   /*Liên kết VMA1 và VMA0*/
   vma0->vm_next = vma1;
   vma1->vm_next = NULL;
 
+  vma0->vm_shm = NULL;
+  vma1->vm_shm = NULL;
+
   /* Point vma owner backward */
   vma0->vm_mm = mm;
   vma1->vm_mm = mm;
 
   /* TODO: update mmap */
   mm->mmap = vma0;
+  mm->vmatbl = NULL;
+  mm->vmatbl_sz = 0;
+  set_vma_by_num(mm, vma0->vm_id, vma0);
+  set_vma_by_num(mm, vma1->vm_id, vma1);
+  mm->symrgtbl = calloc(PAGING_SYMTBL_INIT_SZ, sizeof(struct vm_rg_struct));
+  mm->symrgtbl_sz = PAGING_SYMTBL_INIT_SZ;
   
  /* Thiết lập danh sách trang trống */
-  mm->fifo_pgn = NULL;
+  mm->resident = NULL;
+  mm->clock_hand = NULL;
+  pthread_mutex_init(&mm->lock, NULL);
+  mm->tlb_hit = 0;
+  mm->tlb_miss = 0;
+  mm->pgfault = 0;
+  mm->pgzero = 0;
+  mm->cowfault = 0;
+  mm->ra_next = -1;
+  mm->ra_win = 0;
+  /* Charged to no group until the loader attaches the process */
+  mm->memcg = NULL;
+  mm->rss_charged = mm->rss_peak = mm->rss_evict = 0;
+  mm->rss_max = 0;
+  mm->rss_pff = 0;
+  mm->swapper_fault = mm->swapper_access = 0;
+  mm->pgretry = 0;
   return 0;
 
 
@@ -406,7 +586,8 @@ int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
 
   for(pgit = pgn_start; pgit < pgn_end; pgit++)
   {
-     printf("%08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+     printf("%08ld: %0*llx\n", pgit * sizeof(pte_t), (int)(2 * sizeof(pte_t)),
+            (unsigned long long)caller->mm->pgd[pgit]);
   }
 
   return 0;
@@ -9,14 +9,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
+#ifdef MM_PAGING
+static int cpu_stopped;
+static int mm_worker_done;
+#endif
 
 #ifdef MM_PAGING
 static int memramsz;
 static int memswpsz[PAGING_MAX_MMSWP];
+static char *memswpfile[PAGING_MAX_MMSWP];
+static int memswpprio[PAGING_MAX_MMSWP];
+static long zswappoolsz;
 #ifdef MM_PAGING_HEAP_GODOWN
 static int vmemsz;
 #endif
@@ -37,6 +45,9 @@ static struct ld_args{
 #ifdef MLQ_SCHED
 	unsigned long * prio;
 #endif
+#ifdef MM_PAGING
+	int * rss_max; /* resident frame limit, -1 for the default */
+#endif
 } ld_processes;
 int num_processes;
 
@@ -49,23 +60,32 @@ struct cpu_args {
 static void * cpu_routine(void * args) {
 	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
 	int id = ((struct cpu_args*)args)->id;
+#ifdef MM_PAGING
+	/* Frame allocation of this CPU goes through its own magazine */
+	MEMPHY_bind_cpu(id);
+#endif
 	/* Check for new process in ready queue */
 	int time_left = 0;
 	struct pcb_t * proc = NULL;
+	enter_slot(timer_id);
 	while (1) {
 		/* Check the status of current process */
 		if (proc == NULL) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
 			proc = get_proc();
-			if (proc == NULL) {
-                           next_slot(timer_id);
-                           continue; /* First load failed. skip dummy load */
-                        }
 		}else if (proc->pc == proc->code->size) {
 			/* The porcess has finish it job */
 			printf("\tCPU %d: Processed %2d has finished\n",
 				id ,proc->pid);
+#ifdef MM_PAGING
+			printf("\tPID %2d: TLB hit=%d miss=%d page faults=%d (zero-fill %d, copy-on-write %d)\n",
+				proc->pid, proc->mm->tlb_hit, proc->mm->tlb_miss,
+				proc->mm->pgfault, proc->mm->pgzero, proc->mm->cowfault);
+			memcg_report_mm(proc->pid, proc->mm);
+			/* Give frames and swap slots back before the PCB goes */
+			free_pcb_memph(proc);
+#endif
 			free(proc);
 			proc = get_proc();
 			time_left = 0;
@@ -73,14 +93,22 @@ static void * cpu_routine(void * args) {
 			/* The process has done its job in current time slot */
 			printf("\tCPU %d: Put process %2d to run queue\n",
 				id, proc->pid);
+#ifdef MM_PAGING
+			swapper_account(proc->mm);
+#endif
 			put_proc(proc);
 			proc = get_proc();
 		}
 		
 		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
-			/* No process to run, exit */
+		if (proc == NULL && done && queue_empty()) {
+			/* No process to run or suspended, exit */
 			printf("\tCPU %d stopped\n", id);
+#ifdef MM_PAGING
+			/* The memory workers stop in the slot of the last CPU */
+			if (__atomic_add_fetch(&cpu_stopped, 1, __ATOMIC_ACQ_REL) == num_cpus)
+				__atomic_store_n(&mm_worker_done, 1, __ATOMIC_RELEASE);
+#endif
 			break;
 		}else if (proc == NULL) {
 			/* There may be new processes to run in
@@ -88,6 +116,8 @@ static void * cpu_routine(void * args) {
 			next_slot(timer_id);
 			continue;
 		}else if (time_left == 0) {
+			/* TLB entries are tagged with their mm, a context
+			 * switch keeps them, no flush needed here */
 			printf("\tCPU %d: Dispatched process %2d\n",
 				id, proc->pid);
 			time_left = time_slot;
@@ -102,6 +132,89 @@ static void * cpu_routine(void * args) {
 	pthread_exit(NULL);
 }
 
+#ifdef MM_PAGING
+struct mm_worker_args {
+	struct timer_id_t * timer_id;
+	struct memphy_struct * mram;
+};
+
+/* kswapd_routine - background reclaim, runs once per time slot until
+ * every CPU and the loader are finished
+ */
+static void * kswapd_routine(void * args) {
+	struct timer_id_t * timer_id = ((struct mm_worker_args *)args)->timer_id;
+	struct memphy_struct * mram = ((struct mm_worker_args *)args)->mram;
+	enter_slot(timer_id);
+	while (!__atomic_load_n(&mm_worker_done, __ATOMIC_ACQUIRE)) {
+		kswapd_balance(mram);
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+/* zerod_routine - refill the pool of pre-zeroed frames, runs once per
+ * time slot until every CPU and the loader are finished
+ */
+static void * zerod_routine(void * args) {
+	struct timer_id_t * timer_id = ((struct mm_worker_args *)args)->timer_id;
+	struct memphy_struct * mram = ((struct mm_worker_args *)args)->mram;
+	enter_slot(timer_id);
+	while (!__atomic_load_n(&mm_worker_done, __ATOMIC_ACQUIRE)) {
+		zero_refill(mram);
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+/* ksmd_routine - merge pages of identical content, runs once per time
+ * slot until every CPU and the loader are finished
+ */
+static void * ksmd_routine(void * args) {
+	struct timer_id_t * timer_id = ((struct mm_worker_args *)args)->timer_id;
+	struct memphy_struct * mram = ((struct mm_worker_args *)args)->mram;
+	enter_slot(timer_id);
+	while (!__atomic_load_n(&mm_worker_done, __ATOMIC_ACQUIRE)) {
+		ksm_scan(mram);
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+/* pffd_routine - adjust frame budgets from the page fault rates, runs
+ * once per time slot until every CPU and the loader are finished
+ */
+static void * pffd_routine(void * args) {
+	struct timer_id_t * timer_id = ((struct mm_worker_args *)args)->timer_id;
+	struct memphy_struct * mram = ((struct mm_worker_args *)args)->mram;
+	enter_slot(timer_id);
+	while (!__atomic_load_n(&mm_worker_done, __ATOMIC_ACQUIRE)) {
+		pff_balance(mram);
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+/* swapperd_routine - suspend and resume processes from the swap-in
+ * rate, runs once per time slot until every CPU and the loader are
+ * finished
+ */
+static void * swapperd_routine(void * args) {
+	struct timer_id_t * timer_id = ((struct mm_worker_args *)args)->timer_id;
+	struct memphy_struct * mram = ((struct mm_worker_args *)args)->mram;
+	enter_slot(timer_id);
+	while (!__atomic_load_n(&mm_worker_done, __ATOMIC_ACQUIRE)) {
+		swapper_balance(mram);
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+#endif
+
 static void * ld_routine(void * args) {
 #ifdef MM_PAGING
 	struct memphy_struct* mram = ((struct mmpaging_ld_args *)args)->mram;
@@ -112,6 +225,7 @@ static void * ld_routine(void * args) {
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 #endif
 	int i = 0;
+	enter_slot(timer_id);
 	printf("ld_routine\n");
 	while (i < num_processes) {
 		struct pcb_t * proc = load(ld_processes.path[i]);
@@ -127,6 +241,13 @@ static void * ld_routine(void * args) {
 		proc->vmemsz = vmemsz;
 #endif
 		init_mm(proc->mm, proc);
+#ifdef MLQ_SCHED
+		memcg_attach(proc->mm, ld_processes.prio[i], ld_processes.rss_max[i]);
+#else
+		memcg_attach(proc->mm, 0, ld_processes.rss_max[i]);
+#endif
+		pff_attach(proc->mm, proc->pid);
+		swapper_attach(proc->mm);
 		proc->mram = mram;
 		proc->mswp = mswp;
 		proc->active_mswp = active_mswp;
@@ -140,11 +261,149 @@ static void * ld_routine(void * args) {
 	}
 	free(ld_processes.path);
 	free(ld_processes.start_time);
+#ifdef MM_PAGING
+	free(ld_processes.rss_max);
+#endif
 	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+#ifdef MM_PAGING
+/* match_idx_opt - match an indexed option "<prefix><N><suffix>"
+ * return N, or -1 unless 0 <= N < max
+ */
+static int match_idx_opt(const char * key, const char * prefix,
+		const char * suffix, int max) {
+	int idx, n = 0, len = strlen(prefix);
+	if (strncmp(key, prefix, len) ||
+			sscanf(key + len, "%d%n", &idx, &n) != 1 || strcmp(key + len + n, suffix))
+		return -1;
+	if (idx < 0 || idx >= max)
+		return -1;
+	return idx;
+}
+
+/* match_swp_opt - match a per swap device option "memswp<N><suffix>"
+ * return the swap device index or -1
+ */
+static int match_swp_opt(const char * key, const char * suffix) {
+	return match_idx_opt(key, "memswp", suffix, PAGING_MAX_MMSWP);
+}
+
+/* read_mm_opts - read optional MM options following the process list
+ * Format: one "<key> <value>" pair per line
+ *        mm_page_sz <bytes>     page size, a power of two (default 256)
+ *        mm_bus_width <bits>    width of a virtual address (default 22)
+ *        memswp<N>_file <path>  back swap device N with a sparse file
+ *        memswp<N>_prio <prio>  priority tier of swap device N (default 0)
+ *        zswap_pool_sz <bytes>  compressed swap cache pool size (default 0, off)
+ *        mm_repl_scope <scope>  page replacement victims from "global" (default)
+ *                               every process or "local" faulting one only
+ *        mm_repl_policy <name>  page replacement policy: fifo (default),
+ *                               second, clock or lru
+ *        mm_alloc_mode <mode>   map frames at alloc time "eager" (default)
+ *                               or on first access "lazy"
+ *        mm_readahead <pages>   largest swap-in readahead window (default 0, off)
+ *        mm_sbrk_max <bytes>    largest virtual space reserved when a heap
+ *                               grows (default 0, a page or less off)
+ *        mm_hugepage <pages>    pages of a huge page, a power of two
+ *                               (default 0, off)
+ *        mm_kswapd_low <frames> wake background reclaim below this many free
+ *                               RAM frames (default 0, off)
+ *        mm_kswapd_high <frames> reclaim up to this many free frames
+ *                               (default twice the low watermark)
+ *        mm_zero_pool <frames>  free RAM frames kept cleared in the
+ *                               background (default 0, off)
+ *        mm_ksm_scan <frames>   RAM frames scanned per time slot to merge
+ *                               pages of identical content (default 0, off)
+ *        mm_rss_max <frames>    resident RAM frames of every process
+ *                               (default 0, no limit)
+ *        mm_proc<I>_rss_max <frames> resident RAM frames of the I-th
+ *                               process of the list and its forks
+ *        mm_prio<N>_rss_max <frames> resident RAM frames of all the
+ *                               processes of priority N together
+ *        mm_pff_high <percent>  page faults per 100 accesses above which a
+ *                               process gets more frames (default 0, off)
+ *        mm_pff_low <percent>   page faults per 100 accesses below which
+ *                               frames are taken back under memory
+ *                               pressure (default 0, never)
+ *        mm_swapper_high <percent> swap-ins per 100 accesses above which
+ *                               processes are suspended (default 0, off)
+ *        mm_swapper_low <percent> swap-ins per 100 accesses below which
+ *                               they are resumed (default half the high)
+ *        mm_swapper_batch <frames> frames of suspended processes swapped
+ *                               out per time slot (default 4)
+ *        mm_oom_kill <0|1>      kill a process when an allocation finds
+ *                               neither RAM nor swap (default 1, on)
+ */
+static void read_mm_opts(FILE * file) {
+	char line[512], key[64], val[256];
+	int sit;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		/* Configs without the memory line leave process lines here,
+		 * only a line starting with a name is an option */
+		if (sscanf(line, "%63s %255s", key, val) != 2 || !isalpha((unsigned char)key[0]))
+			continue;
+		if (!strcmp(key, "mm_page_sz")) {
+			mm_pagesz = atoi(val);
+		}else if (!strcmp(key, "mm_bus_width")) {
+			mm_bus_width = atoi(val);
+		}else if ((sit = match_swp_opt(key, "_file")) >= 0) {
+			memswpfile[sit] = strdup(val);
+		}else if ((sit = match_swp_opt(key, "_prio")) >= 0) {
+			memswpprio[sit] = atoi(val);
+		}else if (!strcmp(key, "zswap_pool_sz")) {
+			zswappoolsz = atol(val);
+		}else if (!strcmp(key, "mm_repl_scope")) {
+			mm_repl_global = strcmp(val, "local") ? 1 : 0;
+		}else if (!strcmp(key, "mm_alloc_mode")) {
+			mm_lazy_alloc = strcmp(val, "lazy") ? 0 : 1;
+		}else if (!strcmp(key, "mm_kswapd_low")) {
+			mm_kswapd_low = atoi(val);
+		}else if (!strcmp(key, "mm_kswapd_high")) {
+			mm_kswapd_high = atoi(val);
+		}else if (!strcmp(key, "mm_zero_pool")) {
+			mm_zero_pool = atoi(val);
+		}else if (!strcmp(key, "mm_ksm_scan")) {
+			mm_ksm_scan = atoi(val);
+		}else if (!strcmp(key, "mm_pff_high")) {
+			mm_pff_high = atoi(val);
+		}else if (!strcmp(key, "mm_pff_low")) {
+			mm_pff_low = atoi(val);
+		}else if (!strcmp(key, "mm_swapper_high")) {
+			mm_swapper_high = atoi(val);
+		}else if (!strcmp(key, "mm_swapper_low")) {
+			mm_swapper_low = atoi(val);
+		}else if (!strcmp(key, "mm_swapper_batch")) {
+			mm_swapper_batch = atoi(val);
+		}else if (!strcmp(key, "mm_oom_kill")) {
+			mm_oom_kill = atoi(val);
+		}else if (!strcmp(key, "mm_rss_max")) {
+			mm_rss_max = atoi(val);
+		}else if ((sit = match_idx_opt(key, "mm_proc", "_rss_max", num_processes)) >= 0) {
+			ld_processes.rss_max[sit] = atoi(val);
+		}else if ((sit = match_idx_opt(key, "mm_prio", "_rss_max", MAX_PRIO)) >= 0) {
+			memcg_set_limit(sit, atoi(val));
+		}else if (!strcmp(key, "mm_readahead")) {
+			mm_ra_max = atoi(val);
+		}else if (!strcmp(key, "mm_sbrk_max")) {
+			mm_sbrk_max = atoi(val);
+		}else if (!strcmp(key, "mm_hugepage")) {
+			mm_huge_pgn = atoi(val);
+		}else if (!strcmp(key, "mm_repl_policy")) {
+			if ((mm_repl_policy = repl_parse_policy(val)) < 0) {
+				printf("Unknown replacement policy '%s'\n", val);
+				exit(1);
+			}
+		}else{
+			printf("Unknown option '%s' in configure file\n", key);
+			exit(1);
+		}
+	}
+}
+#endif
+
 static void read_config(const char * path) {
 	FILE * file;
 	if ((file = fopen(path, "r")) == NULL) {
@@ -203,6 +462,12 @@ static void read_config(const char * path) {
 #endif
 		strcat(ld_processes.path[i], proc);
 	}
+#ifdef MM_PAGING
+	ld_processes.rss_max = (int*)malloc(sizeof(int) * num_processes);
+	for (i = 0; i < num_processes; i++)
+		ld_processes.rss_max[i] = -1;
+	read_mm_opts(file);
+#endif
 }
 
 int main(int argc, char * argv[]) {
@@ -222,13 +487,22 @@ int main(int argc, char * argv[]) {
 		(struct cpu_args*)malloc(sizeof(struct cpu_args) * num_cpus);
 	pthread_t ld;
 	
-	/* Init timer */
+	/* Init timer, the loader runs first in a slot */
 	int i;
+	struct timer_id_t * ld_event = attach_event();
 	for (i = 0; i < num_cpus; i++) {
 		args[i].timer_id = attach_event();
 		args[i].id = i;
 	}
-	struct timer_id_t * ld_event = attach_event();
+#ifdef MM_PAGING
+	pthread_t kswapd, zerod, ksmd, pffd, swapperd;
+	struct mm_worker_args kswapd_args, zerod_args, ksmd_args, pffd_args, swapperd_args;
+	kswapd_args.timer_id = (mm_kswapd_low > 0) ? attach_event() : NULL;
+	zerod_args.timer_id = (mm_zero_pool > 0) ? attach_event() : NULL;
+	ksmd_args.timer_id = (mm_ksm_scan > 0) ? attach_event() : NULL;
+	pffd_args.timer_id = (mm_pff_high > 0) ? attach_event() : NULL;
+	swapperd_args.timer_id = (mm_swapper_high > 0) ? attach_event() : NULL;
+#endif
 	start_timer();
 
 #ifdef MM_PAGING
@@ -238,13 +512,31 @@ int main(int argc, char * argv[]) {
 	struct memphy_struct mram;
 	struct memphy_struct mswp[PAGING_MAX_MMSWP];
 
+	if (init_paging(memramsz, memswpsz, PAGING_MAX_MMSWP) < 0)
+		exit(1);
+
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+	MEMPHY_init_rmap(&mram);
+	MEMPHY_init_zero(&mram, mm_zero_pool);
 
         /* Create all MEM SWAP */ 
 	int sit;
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+		if (memswpfile[sit] == NULL) {
+			init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+		}else if (init_memphy_file(&mswp[sit], memswpsz[sit], rdmflag, memswpfile[sit]) < 0) {
+			printf("Cannot map swap file at %s\n", memswpfile[sit]);
+			exit(1);
+		}
+	}
+
+	/* Every non-empty MEMSWP serves swap slots through the swap manager */
+	if (init_swap(mswp, memswpprio, PAGING_MAX_MMSWP) < 0) {
+		printf("No usable swap device\n");
+		exit(1);
+	}
+	init_zswap(zswappoolsz);
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
@@ -272,16 +564,67 @@ int main(int argc, char * argv[]) {
 		pthread_create(&cpu[i], NULL,
 			cpu_routine, (void*)&args[i]);
 	}
+#ifdef MM_PAGING
+	if (kswapd_args.timer_id != NULL) {
+		kswapd_args.mram = &mram;
+		pthread_create(&kswapd, NULL, kswapd_routine, (void*)&kswapd_args);
+	}
+	if (zerod_args.timer_id != NULL) {
+		zerod_args.mram = &mram;
+		pthread_create(&zerod, NULL, zerod_routine, (void*)&zerod_args);
+	}
+	if (ksmd_args.timer_id != NULL) {
+		ksmd_args.mram = &mram;
+		pthread_create(&ksmd, NULL, ksmd_routine, (void*)&ksmd_args);
+	}
+	if (pffd_args.timer_id != NULL) {
+		pffd_args.mram = &mram;
+		pthread_create(&pffd, NULL, pffd_routine, (void*)&pffd_args);
+	}
+	if (swapperd_args.timer_id != NULL) {
+		swapperd_args.mram = &mram;
+		pthread_create(&swapperd, NULL, swapperd_routine, (void*)&swapperd_args);
+	}
+#endif
 
 	/* Wait for CPU and loader finishing */
 	for (i = 0; i < num_cpus; i++) {
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+#ifdef MM_PAGING
+	if (kswapd_args.timer_id != NULL)
+		pthread_join(kswapd, NULL);
+	if (zerod_args.timer_id != NULL)
+		pthread_join(zerod, NULL);
+	if (ksmd_args.timer_id != NULL)
+		pthread_join(ksmd, NULL);
+	if (pffd_args.timer_id != NULL)
+		pthread_join(pffd, NULL);
+	if (swapperd_args.timer_id != NULL)
+		pthread_join(swapperd, NULL);
+#endif
 
 	/* Stop timer */
 	stop_timer();
 
+#ifdef MM_PAGING
+	repl_report();
+	kswapd_report();
+	zero_report();
+	swap_report();
+	zswap_report();
+	readahead_report();
+	sbrk_report();
+	huge_report();
+	shm_report();
+	ksm_report(&mram);
+	memcg_report();
+	pff_report();
+	swapper_report();
+	oom_report();
+#endif
+
 	return 0;
 
 }
\ No newline at end of file
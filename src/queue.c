@@ -73,6 +73,25 @@ struct pcb_t *dequeue(struct queue_t *q)
 #endif
 }
 
+/* Remove the process at [index] of queue [q], keeping the order of the
+ * others, and return it */
+struct pcb_t *remove_at(struct queue_t *q, int index)
+{
+        struct pcb_t *temp;
+        if (q == NULL || index < 0 || index >= q->size)
+        {
+                return NULL;
+        }
+        temp = q->proc[index];
+        for (int i = index; i < q->size - 1; ++i)
+        {
+                q->proc[i] = q->proc[i + 1];
+        }
+        q->proc[q->size - 1] = NULL;
+        q->size--;
+        return temp;
+}
+
 #ifdef TEST_QUEUE
 void initProc(struct pcb_t *proc);
 void printProc(struct pcb_t *proc);
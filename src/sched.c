@@ -8,6 +8,8 @@
 
 static struct queue_t ready_queue;
 static struct queue_t run_queue;
+/* Processes the medium-term scheduler took out of scheduling */
+static struct queue_t suspend_queue;
 static pthread_mutex_t queue_lock;
 
 // #define TEST_SCHED
@@ -22,15 +24,20 @@ static struct queue_t mlq_ready_queue[MAX_PRIO];
 static int slot[MAX_PRIO];
 #endif
 
+/* Return 1 if no process waits to run, suspended ones included */
 int queue_empty(void)
 {
+	int ret;
+	pthread_mutex_lock(&queue_lock);
+	ret = empty(&ready_queue) && empty(&run_queue) && empty(&suspend_queue);
 #ifdef MLQ_SCHED
 	unsigned long prio;
 	for (prio = 0; prio < MAX_PRIO; prio++)
 		if (!empty(&mlq_ready_queue[prio]))
-			return -1;
+			ret = 0;
 #endif
-	return (empty(&ready_queue) && empty(&run_queue));
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
 }
 
 void init_scheduler(void)
@@ -45,6 +52,7 @@ void init_scheduler(void)
 #endif
 	ready_queue.size = 0;
 	run_queue.size = 0;
+	suspend_queue.size = 0;
 	pthread_mutex_init(&queue_lock, NULL);
 }
 
@@ -141,6 +149,103 @@ void add_proc(struct pcb_t *proc)
 }
 #endif
 
+/* Keep in [vq][vidx] the best victim of [q] and the one found so far */
+static void find_victim(struct queue_t *q, int (*better)(struct pcb_t *, struct pcb_t *),
+			struct queue_t **vq, int *vidx)
+{
+	for (int i = 0; i < q->size; i++)
+		if (*vq == NULL || better(q->proc[i], (*vq)->proc[*vidx]))
+		{
+			*vq = q;
+			*vidx = i;
+		}
+}
+
+/* Remove from the ready queues the best victim, if it is a better one
+ * than [than] when given. Caller holds queue_lock */
+static struct pcb_t *take_victim(int (*better)(struct pcb_t *, struct pcb_t *),
+				 struct pcb_t *than)
+{
+	struct queue_t *vq = NULL;
+	int vidx = 0;
+
+#ifdef MLQ_SCHED
+	for (int i = 0; i < MAX_PRIO; i++)
+		find_victim(&mlq_ready_queue[i], better, &vq, &vidx);
+#else
+	find_victim(&ready_queue, better, &vq, &vidx);
+	find_victim(&run_queue, better, &vq, &vidx);
+#endif
+	if (vq == NULL || (than != NULL && !better(vq->proc[vidx], than)))
+		return NULL;
+
+	return remove_at(vq, vidx);
+}
+
+/*
+ *  suspend_proc - take a ready process out of scheduling
+ *  @better: nonzero if its first process is a better victim than its second
+ *  The process waits in the suspend queue until resume_proc, a process
+ *  running on a CPU is never taken
+ *  Return the process suspended, NULL if none is ready
+ */
+struct pcb_t *suspend_proc(int (*better)(struct pcb_t *, struct pcb_t *))
+{
+	struct pcb_t *proc = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	if (suspend_queue.size < MAX_QUEUE_SIZE)
+	{
+		proc = take_victim(better, NULL);
+		if (proc != NULL)
+			enqueue(&suspend_queue, proc);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return proc;
+}
+
+/*
+ *  take_proc - take a ready process out of scheduling for good
+ *  @better: nonzero if its first process is a better victim than its second
+ *  @than: process the victim has to be better than, NULL for any
+ *  Suspended processes and processes running on a CPU are never taken
+ *  Return the process taken, NULL if none qualifies
+ */
+struct pcb_t *take_proc(int (*better)(struct pcb_t *, struct pcb_t *), struct pcb_t *than)
+{
+	struct pcb_t *proc;
+
+	pthread_mutex_lock(&queue_lock);
+	proc = take_victim(better, than);
+	pthread_mutex_unlock(&queue_lock);
+
+	return proc;
+}
+
+/*
+ *  resume_proc - put the longest suspended process back to ready queue
+ *  Return the process resumed, NULL if none is suspended
+ */
+struct pcb_t *resume_proc(void)
+{
+	struct pcb_t *proc;
+
+	pthread_mutex_lock(&queue_lock);
+	proc = remove_at(&suspend_queue, 0);
+	if (proc != NULL)
+	{
+#ifdef MLQ_SCHED
+		enqueue(&mlq_ready_queue[proc->prio], proc);
+#else
+		enqueue(&ready_queue, proc);
+#endif
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return proc;
+}
+
 #ifdef TEST_SCHED
 #include "common.h"
 void initProc(struct pcb_t *proc, int prio);
@@ -1,5 +1,6 @@
 
 #include "timer.h"
+#include "os-cfg.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -27,6 +28,14 @@ static void * timer_routine(void * args) {
 		 * time slot */
 		struct timer_id_container_t * temp;
 		for (temp = dev_list; temp != NULL; temp = temp->next) {
+#ifdef SLOT_LOCKSTEP
+			/* One device at a time, in the order they were
+			 * attached, so that a run is reproducible */
+			pthread_mutex_lock(&temp->id.timer_lock);
+			temp->id.turn = 1;
+			pthread_cond_signal(&temp->id.timer_cond);
+			pthread_mutex_unlock(&temp->id.timer_lock);
+#endif
 			pthread_mutex_lock(&temp->id.event_lock);
 			while (!temp->id.done && !temp->id.fsh) {
 				pthread_cond_wait(
@@ -58,6 +67,23 @@ static void * timer_routine(void * args) {
 	pthread_exit(args);
 }
 
+void enter_slot(struct timer_id_t * timer_id) {
+#ifdef SLOT_LOCKSTEP
+	/* Wait until the timer lets us run the job of the current slot */
+	pthread_mutex_lock(&timer_id->timer_lock);
+	while (!timer_id->turn) {
+		pthread_cond_wait(
+			&timer_id->timer_cond,
+			&timer_id->timer_lock
+		);
+	}
+	timer_id->turn = 0;
+	pthread_mutex_unlock(&timer_id->timer_lock);
+#else
+	(void)timer_id;
+#endif
+}
+
 void next_slot(struct timer_id_t * timer_id) {
 	/* Tell to timer that we have done our job in current slot */
 	pthread_mutex_lock(&timer_id->event_lock);
@@ -74,6 +100,8 @@ void next_slot(struct timer_id_t * timer_id) {
 		);
 	}
 	pthread_mutex_unlock(&timer_id->timer_lock);
+
+	enter_slot(timer_id);
 }
 
 uint64_t current_time() {
@@ -102,17 +130,19 @@ struct timer_id_t * attach_event() {
 			);
 		container->id.done = 0;
 		container->id.fsh = 0;
+		container->id.turn = 0;
 		pthread_cond_init(&container->id.event_cond, NULL);
 		pthread_mutex_init(&container->id.event_lock, NULL);
 		pthread_cond_init(&container->id.timer_cond, NULL);
 		pthread_mutex_init(&container->id.timer_lock, NULL);
-		if (dev_list == NULL) {
-			dev_list = container;
-			dev_list->next = NULL;
-		}else{
-			container->next = dev_list;
-			dev_list = container;
+		/* Kept in the order of attachment, the order devices
+		 * run in with SLOT_LOCKSTEP */
+		struct timer_id_container_t ** tail = &dev_list;
+		while (*tail != NULL) {
+			tail = &(*tail)->next;
 		}
+		container->next = NULL;
+		*tail = container;
 		return &(container->id);
 	}
 }